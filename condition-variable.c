@@ -1,23 +1,423 @@
+/*
+build:
+gcc -O2 -Wall -pthread condition-variable.c -o condition-variable
+*/
+
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "queue.h"
- 
-pthread_t tid1, tid2, tid3; 
+
+#define MAX_PRODUCERS   16
+#define TASKS           1000000     // per producer, -n changes it
+#define TASK_BATCH      256         // tasks a pool takes from malloc at once
+#define MAGAZINE        64          // tasks handed back to another thread's pool in one push
+#define MAX_WORKERS     MAX_PRODUCERS   // a worker uses the pool of the producer with its index
+#define MAX_POOLS       (MAX_PRODUCERS + 1)
+#define BURST_PAUSE_US  20          // producers rest this long between bursts with -b
+
+pthread_t tid1, tid2[MAX_PRODUCERS];
 pthread_cond_t cond1 = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
- 
+
 typedef struct Task
 {
     SIMPLEQ_ENTRY(Task) simpleq;
+    struct Task * next;             // mpsc link, free list link in a pool
+    struct task_pool * owner;
     int value;
+    void (*run)(struct Task * task);    // work-stealing pool
+    uint32_t * join;                // parent's count of children not done yet
+    long * result;
+    long lo, hi;
 } Task;
 
+struct task_slab
+{
+    struct task_slab * next;
+    Task tasks[TASK_BATCH];
+};
+
+// one per thread. the owner allocates from cache without atomics and
+// refills it by taking everything other threads returned in one exchange,
+// malloc only comes in when both are empty. other threads collect the
+// tasks they free in a magazine per owner and push a whole magazine onto
+// remote with one compare and swap. only the owner ever takes from remote
+// and it takes the whole list, so the stack has no ABA problem.
+struct task_pool
+{
+    Task * remote __attribute__((aligned(64)));
+    Task * cache __attribute__((aligned(64)));
+    struct task_slab * slabs;
+};
+
+struct magazine
+{
+    Task * head;
+    Task * tail;
+    unsigned int count;
+};
+
+static struct task_pool pools[MAX_POOLS];
+static __thread struct task_pool * local_pool;
+static __thread struct magazine magazines[MAX_POOLS];
+
 typedef SIMPLEQ_HEAD(Task_Q, Task) Task_Q;
 static Task_Q queue;
-int loop = 1;
+
+// batch mode: the consumer moves everything queued into batch in one
+// lock hold and works through it unlocked. sleeping is set by the
+// consumer before it waits and cleared by the producer that signals it,
+// both under the lock, so only a push into an empty queue with the
+// consumer asleep signals and a burst costs one wakeup.
+static Task_Q batch;
+static int sleeping;
+
+// intrusive Vyukov queue: producers swap themselves in as the head with one
+// exchange, the consumer walks from the tail. a producer preempted between
+// the exchange and linking its predecessor hides everything behind it until
+// it links, the consumer sees an empty queue meanwhile.
+static struct
+{
+    Task * head __attribute__((aligned(64)));
+    Task * tail __attribute__((aligned(64)));
+    Task stub;
+} mpsc;
+
+// the consumer announces itself in sleeping before its last look at the
+// queue and sleeps on seq. the producer that takes the flag back bumps seq
+// and wakes it, the others see a clear flag and skip the syscall, so a
+// consumer that is slow to get scheduled costs one wake, not one per push.
+// neither side takes a lock.
+static struct
+{
+    uint32_t seq;
+    uint32_t sleeping;
+} eventcount;
+
+static struct
+{
+    unsigned long sleeps;           // consumer futex waits or cond waits
+    unsigned long wakes;            // producer futex wakes or cond signals
+    unsigned long mallocs;          // calls into the general purpose allocator
+    unsigned long locks;            // consumer lock acquisitions
+} stats;
+
+static long tasks = TASKS;
+static long burst;
+static long expected;
+static long consumed;
+static long long sum;
+
+struct queue_ops
+{
+    const char * name;
+    void (*push)(Task * task);
+    Task * (*pop)(void);            // blocks until there is a task
+};
+
+struct task_allocator
+{
+    const char * name;
+    Task * (*alloc)(void);
+    void (*free)(Task * task);
+};
+
+static long futex(uint32_t * addr, int op, uint32_t value)
+{
+    return syscall(SYS_futex, addr, op, value, NULL, NULL, 0);
+}
+
+static void mutex_push(Task * task)
+{
+    pthread_mutex_lock(&lock);
+    SIMPLEQ_INSERT_TAIL(&queue, task, simpleq);
+    ++stats.wakes;
+    pthread_cond_signal(&cond1);
+    pthread_mutex_unlock(&lock);
+}
+
+static Task * mutex_pop(void)
+{
+    pthread_mutex_lock(&lock);
+    ++stats.locks;
+    Task * task;
+    while ((task = SIMPLEQ_FIRST(&queue)) == NULL)
+    {
+        ++stats.sleeps;
+        pthread_cond_wait(&cond1, &lock);
+    }
+    SIMPLEQ_REMOVE_HEAD(&queue, simpleq);
+    pthread_mutex_unlock(&lock);
+    return task;
+}
+
+static void batch_push(Task * task)
+{
+    pthread_mutex_lock(&lock);
+    SIMPLEQ_INSERT_TAIL(&queue, task, simpleq);
+    int wake = sleeping;
+    sleeping = 0;
+    pthread_mutex_unlock(&lock);
+
+    // after unlocking, so the consumer does not wake up into a held lock
+    if (wake)
+    {
+        __atomic_add_fetch(&stats.wakes, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&cond1);
+    }
+}
+
+static Task * batch_pop(void)
+{
+    Task * task = SIMPLEQ_FIRST(&batch);
+    if (task == NULL)
+    {
+        pthread_mutex_lock(&lock);
+        ++stats.locks;
+        while (SIMPLEQ_EMPTY(&queue))
+        {
+            sleeping = 1;
+            ++stats.sleeps;
+            pthread_cond_wait(&cond1, &lock);
+        }
+        sleeping = 0;
+        batch = queue;              // not empty, so sqh_last points into the last task
+        SIMPLEQ_INIT(&queue);
+        pthread_mutex_unlock(&lock);
+        task = SIMPLEQ_FIRST(&batch);
+    }
+    SIMPLEQ_REMOVE_HEAD(&batch, simpleq);
+    return task;
+}
+
+static void mpsc_init(void)
+{
+    mpsc.stub.next = NULL;
+    mpsc.head = &mpsc.stub;
+    mpsc.tail = &mpsc.stub;
+}
+
+static void mpsc_link(Task * task)
+{
+    task->next = NULL;
+    Task * prev = __atomic_exchange_n(&mpsc.head, task, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+static Task * mpsc_try_pop(void)
+{
+    Task * tail = mpsc.tail;
+    Task * next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &mpsc.stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        mpsc.tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next)
+    {
+        mpsc.tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&mpsc.head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;                // a producer is between exchange and link
+    }
+
+    // tail is the last task, put the stub behind it so it can be taken
+    mpsc_link(&mpsc.stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        mpsc.tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void mpsc_push(Task * task)
+{
+    mpsc_link(task);
+
+    // pairs with setting sleeping in mpsc_pop: either the consumer sees
+    // the task on its last look or this sees the consumer going to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&eventcount.sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&eventcount.sleeping, 0, __ATOMIC_ACQ_REL))
+    {
+        __atomic_add_fetch(&eventcount.seq, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&stats.wakes, 1, __ATOMIC_RELAXED);
+        futex(&eventcount.seq, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static Task * mpsc_pop(void)
+{
+    Task * task;
+    while ((task = mpsc_try_pop()) == NULL)
+    {
+        uint32_t key = __atomic_load_n(&eventcount.seq, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&eventcount.sleeping, 1, __ATOMIC_SEQ_CST);
+        if ((task = mpsc_try_pop()) != NULL)
+        {
+            __atomic_store_n(&eventcount.sleeping, 0, __ATOMIC_RELAXED);
+            break;
+        }
+        ++stats.sleeps;
+        futex(&eventcount.seq, FUTEX_WAIT_PRIVATE, key);
+        __atomic_store_n(&eventcount.sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static const struct queue_ops queues[] =
+{
+    {"mutex", mutex_push, mutex_pop},
+    {"batch", batch_push, batch_pop},
+    {"mpsc", mpsc_push, mpsc_pop},
+};
+
+static const struct queue_ops * ops;
+
+static Task * malloc_alloc(void)
+{
+    __atomic_add_fetch(&stats.mallocs, 1, __ATOMIC_RELAXED);
+    return malloc(sizeof(Task));
+}
+
+static void malloc_free(Task * task)
+{
+    free(task);
+}
+
+static Task * pool_refill(struct task_pool * pool)
+{
+    struct task_slab * slab = malloc(sizeof(*slab));
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+    __atomic_add_fetch(&stats.mallocs, 1, __ATOMIC_RELAXED);
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    for (int i = 0; i < TASK_BATCH; ++i)
+    {
+        slab->tasks[i].owner = pool;
+        slab->tasks[i].next = i + 1 < TASK_BATCH ? &slab->tasks[i + 1] : NULL;
+    }
+    return slab->tasks;
+}
+
+static Task * pool_alloc(void)
+{
+    struct task_pool * pool = local_pool;
+    Task * task = pool->cache;
+    if (task == NULL)
+    {
+        task = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+        if (task == NULL && (task = pool_refill(pool)) == NULL)
+        {
+            return NULL;
+        }
+    }
+    pool->cache = task->next;
+    return task;
+}
+
+static void magazine_flush(struct task_pool * owner, struct magazine * magazine)
+{
+    Task * top = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do
+    {
+        magazine->tail->next = top;
+    } while (!__atomic_compare_exchange_n(&owner->remote, &top, magazine->head, 1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    magazine->head = NULL;
+    magazine->tail = NULL;
+    magazine->count = 0;
+}
+
+static void pool_free(Task * task)
+{
+    struct task_pool * owner = task->owner;
+    if (owner == local_pool)
+    {
+        task->next = owner->cache;
+        owner->cache = task;
+        return;
+    }
+
+    struct magazine * magazine = &magazines[owner - pools];
+    task->next = magazine->head;
+    if (magazine->head == NULL)
+    {
+        magazine->tail = task;
+    }
+    magazine->head = task;
+    if (++magazine->count == MAGAZINE)
+    {
+        magazine_flush(owner, magazine);
+    }
+}
+
+// binds the calling thread to a pool, pools outlive the threads so the
+// next thread bound to it starts with what the last one left
+static void pool_attach(struct task_pool * pool)
+{
+    local_pool = pool;
+}
+
+// hands back what is still collected for other pools
+static void pool_detach(void)
+{
+    for (int i = 0; i < MAX_POOLS; ++i)
+    {
+        if (magazines[i].count)
+        {
+            magazine_flush(&pools[i], &magazines[i]);
+        }
+    }
+    local_pool = NULL;
+}
+
+static void pool_destroy(struct task_pool * pool)
+{
+    while (pool->slabs)
+    {
+        struct task_slab * slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pool->cache = NULL;
+    pool->remote = NULL;
+}
+
+static const struct task_allocator allocators[] =
+{
+    {"malloc", malloc_alloc, malloc_free},
+    {"pool", pool_alloc, pool_free},
+};
+
+static const struct task_allocator * allocator;
 
 void destroy_task_queues()
 {
@@ -25,65 +425,745 @@ void destroy_task_queues()
     while ((task = SIMPLEQ_FIRST(&queue)) != NULL)
     {
         SIMPLEQ_REMOVE_HEAD(&queue, simpleq);
-        free(task);
+        allocator->free(task);
+    }
+    while ((task = SIMPLEQ_FIRST(&batch)) != NULL)
+    {
+        SIMPLEQ_REMOVE_HEAD(&batch, simpleq);
+        allocator->free(task);
+    }
+    mpsc_init();
+
+    for (int i = 0; i < MAX_POOLS; ++i)
+    {
+        pool_destroy(&pools[i]);
     }
 }
 
-void* foo()
-{  
-    Task * task;
-    pthread_mutex_lock(&lock);
-    while (loop)
+void* foo(void * arg)
+{
+    pool_attach(&pools[MAX_PRODUCERS]);
+    while (consumed < expected)
     {
-        task = SIMPLEQ_FIRST(&queue);
-        if (task)
+        Task * task = ops->pop();
+        sum += task->value;
+        ++consumed;
+        allocator->free(task);
+    }
+    pool_detach();
+    return NULL;
+}
+
+void * goo(void * arg)
+{
+    int producer = (int) (intptr_t) arg;
+    pool_attach(&pools[producer]);
+    for (long i = 0; i < tasks; ++i)
+    {
+        Task * t = allocator->alloc();
+        if (t == NULL)
         {
-            SIMPLEQ_REMOVE_HEAD(&queue, simpleq);
-            printf("getting: %d\n", task->value);
-            free(task);
+            fprintf(stderr, "producer %d out of memory\n", producer);
+            exit(-1);
         }
-        else
+        t->value = producer * 100 + (int) (i & 0xffff);
+        ops->push(t);
+        if (burst && (i + 1) % burst == 0)
         {
-            printf("waiting\n");
-            pthread_cond_wait(&cond1, &lock);
+            usleep(BURST_PAUSE_US);
         }
     }
-    pthread_mutex_unlock(&lock);
-    printf("consumer end\n");
+    pool_detach();
     return NULL;
 }
- 
-void * goo(void * arg)
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int producers)
+{
+    long long want = 0;
+    for (int p = 0; p < producers; ++p)
+    {
+        for (long i = 0; i < tasks; ++i)
+        {
+            want += p * 100 + (i & 0xffff);
+        }
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    expected = tasks * producers;
+    consumed = 0;
+    sum = 0;
+
+    double start = now_s();
+    pthread_create(&tid1, NULL, foo, NULL);
+    for (int p = 0; p < producers; ++p)
+    {
+        pthread_create(&tid2[p], NULL, goo, (void *) (intptr_t) p);
+    }
+    for (int p = 0; p < producers; ++p)
+    {
+        pthread_join(tid2[p], NULL);
+    }
+    pthread_join(tid1, NULL);
+    double elapsed = now_s() - start;
+
+    printf("%-6s %-6s %2d producers: %6.2f Mtasks/s, %.3f sleeps/task, %.3f wakes/task, %.3f locks/task, "
+           "%.4f mallocs/task\n", ops->name, allocator->name, producers, expected / elapsed / 1e6,
+           (double) stats.sleeps / expected, (double) stats.wakes / expected, (double) stats.locks / expected,
+           (double) stats.mallocs / expected);
+
+    if (sum != want)
+    {
+        fprintf(stderr, "%s lost tasks: sum %lld, expected %lld\n", ops->name, sum, want);
+        return -1;
+    }
+    return 0;
+}
+
+// work-stealing pool. every worker owns a Chase-Lev deque: it pushes and
+// takes at the bottom without contention, thieves take from the top with
+// one compare and swap. a worker out of work steals from random victims
+// for a while and then parks on a futex eventcount. spawning only wakes a
+// parked worker when nobody is searching already, a searcher that finds
+// work wakes the next one, so work spreads without a wakeup per spawn.
+// threads outside the pool submit through a locked injection list that
+// the first searcher moves into its deque as a whole.
+struct deque_array
 {
-    for (int i = 0; i < 40; ++i)
+    int64_t mask;
+    struct deque_array * prev;      // smaller arrays thieves may still read
+    Task * slots[];
+};
+
+struct deque
+{
+    int64_t top __attribute__((aligned(64)));
+    int64_t bottom __attribute__((aligned(64)));
+    struct deque_array * array;
+};
+
+struct worker
+{
+    struct deque deque;
+    pthread_t thread;
+    unsigned int id;
+    uint64_t random;
+    unsigned long steals;
+    unsigned long parks;
+} __attribute__((aligned(64)));
+
+static struct
+{
+    struct worker * workers;
+    unsigned int count;
+    unsigned int started;           // threads running, fewer than count if a create failed
+    uint32_t seq __attribute__((aligned(64)));
+    uint32_t sleepers;
+    uint32_t searching;
+    int stop;
+    unsigned long wakes;
+    unsigned long steals;           // summed up when the workers stop
+    unsigned long parks;
+    Task_Q injected;                // under lock
+    uint32_t injected_count;        // peeked at without it
+} ws;
+
+static __thread struct worker * self;
+
+#define DEQUE_SIZE      1024        // initial slots, doubled when full
+#define STEAL_ROUNDS    64          // passes over all victims before parking
+#define ABORT           ((Task *) 1)
+
+static struct deque_array * deque_array_new(int64_t size, struct deque_array * prev)
+{
+    struct deque_array * array = malloc(sizeof(*array) + size * sizeof(Task *));
+    if (array)
+    {
+        array->mask = size - 1;
+        array->prev = prev;
+    }
+    return array;
+}
+
+static int deque_init(struct deque * deque)
+{
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->array = deque_array_new(DEQUE_SIZE, NULL);
+    return deque->array ? 0 : -1;
+}
+
+static void deque_destroy(struct deque * deque)
+{
+    while (deque->array)
+    {
+        struct deque_array * array = deque->array;
+        deque->array = array->prev;
+        free(array);
+    }
+}
+
+// owner only
+static int deque_push(struct deque * deque, Task * task)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    struct deque_array * array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    if (bottom - top > array->mask)
+    {
+        struct deque_array * grown = deque_array_new((array->mask + 1) * 2, array);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        for (int64_t i = top; i < bottom; ++i)
+        {
+            grown->slots[i & grown->mask] = __atomic_load_n(&array->slots[i & array->mask], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+        array = grown;
+    }
+
+    __atomic_store_n(&array->slots[bottom & array->mask], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// owner only, newest first
+static Task * deque_take(struct deque * deque)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    struct deque_array * array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    Task * task = NULL;
+    if (top <= bottom)
+    {
+        task = __atomic_load_n(&array->slots[bottom & array->mask], __ATOMIC_RELAXED);
+        if (top == bottom)
+        {
+            // the last one, race the thieves for it
+            if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            {
+                task = NULL;
+            }
+            __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// any thread, oldest first. ABORT when another thief or the owner won
+static Task * deque_steal(struct deque * deque)
+{
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+
+    struct deque_array * array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    Task * task = __atomic_load_n(&array->slots[top & array->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return ABORT;
+    }
+    return task;
+}
+
+static int deque_empty(struct deque * deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+static void ws_wake_one(void)
+{
+    if (__atomic_load_n(&ws.sleepers, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&ws.seq, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&ws.wakes, 1, __ATOMIC_RELAXED);
+        futex(&ws.seq, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+// new work exists: pairs with the fence in ws_park
+static void ws_notify(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ws.searching, __ATOMIC_RELAXED) == 0)
+    {
+        ws_wake_one();
+    }
+}
+
+static void ws_execute(Task * task)
+{
+    task->run(task);
+    pool_free(task);
+}
+
+// from a worker goes onto its own deque, from anywhere else onto the
+// injection list
+void ws_submit(Task * task)
+{
+    if (self == NULL || deque_push(&self->deque, task) < 0)
     {
         pthread_mutex_lock(&lock);
-        Task * t = malloc(sizeof(Task));
-        t->value = ((int) arg) + i;
-        // printf("Signaling %d\n", t->value);
-        SIMPLEQ_INSERT_TAIL(&queue, t, simpleq);
-        pthread_cond_signal(&cond1);
+        SIMPLEQ_INSERT_TAIL(&ws.injected, task, simpleq);
+        __atomic_add_fetch(&ws.injected_count, 1, __ATOMIC_RELEASE);
         pthread_mutex_unlock(&lock);
-        // sleep(1);
     }
+    ws_notify();
+}
 
-    printf("producer %d end\n", (int) arg);
+static Task * ws_take_injected(struct worker * worker)
+{
+    if (__atomic_load_n(&ws.injected_count, __ATOMIC_ACQUIRE) == 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    uint32_t taken = 0;
+    Task * task = SIMPLEQ_FIRST(&ws.injected);
+    if (task)
+    {
+        SIMPLEQ_REMOVE_HEAD(&ws.injected, simpleq);
+        ++taken;
+        // the rest goes where thieves can get at it
+        Task * next;
+        while ((next = SIMPLEQ_FIRST(&ws.injected)) != NULL && deque_push(&worker->deque, next) == 0)
+        {
+            SIMPLEQ_REMOVE_HEAD(&ws.injected, simpleq);
+            ++taken;
+        }
+    }
+    __atomic_sub_fetch(&ws.injected_count, taken, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock);
+    return task;
+}
+
+static Task * ws_steal(struct worker * worker)
+{
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 7;
+    worker->random ^= worker->random << 17;
+
+    unsigned int start = (unsigned int) (worker->random % ws.count);
+    for (unsigned int i = 0; i < ws.count; ++i)
+    {
+        struct worker * victim = &ws.workers[(start + i) % ws.count];
+        if (victim == worker)
+        {
+            continue;
+        }
+        Task * task = deque_steal(&victim->deque);
+        if (task && task != ABORT)
+        {
+            ++worker->steals;
+            return task;
+        }
+    }
+    return ws_take_injected(worker);
+}
+
+static int ws_has_work(void)
+{
+    for (unsigned int i = 0; i < ws.count; ++i)
+    {
+        if (!deque_empty(&ws.workers[i].deque))
+        {
+            return 1;
+        }
+    }
+    return __atomic_load_n(&ws.injected_count, __ATOMIC_ACQUIRE) != 0;
+}
+
+static void ws_park(struct worker * worker)
+{
+    uint32_t key = __atomic_load_n(&ws.seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&ws.sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&ws.searching, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!ws_has_work() && !__atomic_load_n(&ws.stop, __ATOMIC_ACQUIRE))
+    {
+        ++worker->parks;
+        futex(&ws.seq, FUTEX_WAIT_PRIVATE, key);
+    }
+
+    __atomic_add_fetch(&ws.searching, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&ws.sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+// NULL once the pool stops
+static Task * ws_find_work(struct worker * worker)
+{
+    __atomic_add_fetch(&ws.searching, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&ws.stop, __ATOMIC_ACQUIRE))
+    {
+        for (int round = 0; round < STEAL_ROUNDS; ++round)
+        {
+            Task * task = ws_steal(worker);
+            if (task)
+            {
+                // the last searcher hands the search on before going to work
+                if (__atomic_sub_fetch(&ws.searching, 1, __ATOMIC_SEQ_CST) == 0)
+                {
+                    ws_wake_one();
+                }
+                return task;
+            }
+            sched_yield();
+        }
+        ws_park(worker);
+    }
+    __atomic_sub_fetch(&ws.searching, 1, __ATOMIC_SEQ_CST);
     return NULL;
 }
 
-int main()
+// runs other tasks until join drops to zero, so a waiting parent keeps
+// its worker busy with its own children first
+void ws_sync(uint32_t * join)
 {
+    while (__atomic_load_n(join, __ATOMIC_ACQUIRE))
+    {
+        Task * task = deque_take(&self->deque);
+        if (task == NULL)
+        {
+            task = ws_steal(self);
+        }
+        if (task)
+        {
+            ws_execute(task);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+}
+
+static void * ws_worker(void * arg)
+{
+    self = arg;
+    pool_attach(&pools[self->id]);
+    while (1)
+    {
+        Task * task = deque_take(&self->deque);
+        if (task == NULL && (task = ws_find_work(self)) == NULL)
+        {
+            break;
+        }
+        ws_execute(task);
+    }
+    pool_detach();
+    return NULL;
+}
+
+void ws_stop(void);
+
+int ws_start(unsigned int count)
+{
+    memset(&ws, 0, sizeof(ws));
+    SIMPLEQ_INIT(&ws.injected);
+    ws.workers = aligned_alloc(64, count * sizeof(struct worker));
+    if (ws.workers == NULL)
+    {
+        return -1;
+    }
+    memset(ws.workers, 0, count * sizeof(struct worker));
+    ws.count = count;
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        ws.workers[i].id = i;
+        ws.workers[i].random = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (deque_init(&ws.workers[i].deque) < 0)
+        {
+            ws_stop();
+            return -1;
+        }
+    }
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        if (pthread_create(&ws.workers[i].thread, NULL, ws_worker, &ws.workers[i]) != 0)
+        {
+            ws_stop();
+            return -1;
+        }
+        ++ws.started;
+    }
+    return 0;
+}
+
+// also undoes a ws_start that failed part way
+void ws_stop(void)
+{
+    __atomic_store_n(&ws.stop, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ws.seq, 1, __ATOMIC_RELEASE);
+    futex(&ws.seq, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+    for (unsigned int i = 0; i < ws.count; ++i)
+    {
+        if (i < ws.started)
+        {
+            pthread_join(ws.workers[i].thread, NULL);
+        }
+        deque_destroy(&ws.workers[i].deque);
+        ws.steals += ws.workers[i].steals;
+        ws.parks += ws.workers[i].parks;
+    }
+    free(ws.workers);
+}
+
+// fork/join benchmark: sums a hash over a range, every 16th item is 64
+// times the work and ranges split a quarter to three quarters, so neither
+// the items nor the subtrees are balanced
+#define ITEMS           (1 << 22)   // -i changes it
+#define GRAIN           256         // items a task sums without splitting
+#define HEAVY_EVERY     16
+#define LIGHT_ROUNDS    16
+#define HEAVY_ROUNDS    (LIGHT_ROUNDS * 64)
+
+static long items = ITEMS;
+
+static long item_work(long i)
+{
+    uint64_t x = (uint64_t) i;
+    int rounds = i % HEAVY_EVERY == 0 ? HEAVY_ROUNDS : LIGHT_ROUNDS;
+    for (int r = 0; r < rounds; ++r)
+    {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    return (long) (x >> 56);
+}
+
+static long range_sum(long lo, long hi);
+
+static void range_run(Task * task)
+{
+    *task->result = range_sum(task->lo, task->hi);
+    __atomic_sub_fetch(task->join, 1, __ATOMIC_RELEASE);
+}
+
+static long range_sum(long lo, long hi)
+{
+    if (hi - lo <= GRAIN)
+    {
+        long sum = 0;
+        for (long i = lo; i < hi; ++i)
+        {
+            sum += item_work(i);
+        }
+        return sum;
+    }
+
+    long mid = lo + (hi - lo) / 4;
+    long left;
+    uint32_t join = 1;
+    Task * task = pool_alloc();
+    if (task == NULL)
+    {
+        left = range_sum(lo, mid);  // no memory, do it in place
+        join = 0;
+    }
+    else
+    {
+        task->run = range_run;
+        task->lo = lo;
+        task->hi = mid;
+        task->result = &left;
+        task->join = &join;
+        ws_submit(task);
+    }
+
+    long right = range_sum(mid, hi);
+    ws_sync(&join);
+    return left + right;
+}
+
+static uint32_t root_done;
+static long root_sum;
+
+static void root_run(Task * task)
+{
+    root_sum = range_sum(0, items);
+    __atomic_store_n(&root_done, 1, __ATOMIC_RELEASE);
+    futex(&root_done, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static int run_pool(unsigned int workers, double serial, long want)
+{
+    if (ws_start(workers) < 0)
+    {
+        fprintf(stderr, "failed to start %u workers\n", workers);
+        return -1;
+    }
+
+    // submitted from outside the pool, like any client would
+    pool_attach(&pools[MAX_PRODUCERS]);
+    Task * root = pool_alloc();
+    if (root == NULL)
+    {
+        ws_stop();
+        pool_detach();
+        return -1;
+    }
+    root->run = root_run;
+    root_done = 0;
+
+    double start = now_s();
+    ws_submit(root);
+    while (!__atomic_load_n(&root_done, __ATOMIC_ACQUIRE))
+    {
+        futex(&root_done, FUTEX_WAIT_PRIVATE, 0);
+    }
+    double elapsed = now_s() - start;
+
+    ws_stop();
+    pool_detach();
+
+    printf("pool   %2u workers: %7.1f ms, speedup %5.2f, steals %lu, parks %lu, wakes %lu\n", workers,
+           elapsed * 1e3, serial / elapsed, ws.steals, ws.parks, ws.wakes);
+
+    if (root_sum != want)
+    {
+        fprintf(stderr, "pool lost work: sum %ld, expected %ld\n", root_sum, want);
+        return -1;
+    }
+    return 0;
+}
+
+static int run_pools(unsigned int max_workers)
+{
+    double start = now_s();
+    long want = 0;
+    for (long i = 0; i < items; ++i)
+    {
+        want += item_work(i);
+    }
+    double serial = now_s() - start;
+    printf("serial           %7.1f ms\n", serial * 1e3);
+
+    for (unsigned int workers = 1; workers <= max_workers; workers *= 2)
+    {
+        if (run_pool(workers, serial, want) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    const char * only = NULL;
+    const char * only_allocator = NULL;
+    int max_producers = MAX_PRODUCERS;
+    int max_workers = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "q:a:p:n:b:w:i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'q':
+                only = optarg;
+                break;
+            case 'a':
+                only_allocator = optarg;
+                break;
+            case 'p':
+                max_producers = atoi(optarg);
+                if (max_producers < 1 || max_producers > MAX_PRODUCERS)
+                {
+                    fprintf(stderr, "1 to %d producers\n", MAX_PRODUCERS);
+                    return -1;
+                }
+                break;
+            case 'n':
+                tasks = atol(optarg);
+                break;
+            case 'b':
+                burst = atol(optarg);
+                break;
+            case 'w':
+                max_workers = atoi(optarg);
+                if (max_workers < 1 || max_workers > MAX_WORKERS)
+                {
+                    fprintf(stderr, "1 to %d workers\n", MAX_WORKERS);
+                    return -1;
+                }
+                break;
+            case 'i':
+                items = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-q mutex|batch|mpsc] [-a malloc|pool] [-p max producers] [-n tasks per producer] [-b burst]\n"
+                                "\t runs 1, 2, 4 ... max producers against one consumer, every queue and allocator by default\n"
+                                "\t -b makes producers pause %d us after every burst of this many tasks\n"
+                                "       %s -w max workers [-i items]\n"
+                                "\t fork/join sum over skewed items on a work-stealing pool of 1, 2, 4 ... max workers\n",
+                                argv[0], BURST_PAUSE_US, argv[0]);
+                return -1;
+        }
+    }
+
     SIMPLEQ_INIT(&queue);
-    pthread_create(&tid1, NULL, foo, NULL);
-    pthread_create(&tid2, NULL, goo, 100);
-    pthread_create(&tid3, NULL, goo, 200);
-    pthread_join(tid2, NULL);
-    pthread_join(tid3, NULL);
-    sleep(1);
-    loop = 0;
-    pthread_cond_signal(&cond1);
-    printf("main end\n");
-    pthread_join(tid1, NULL);
+    SIMPLEQ_INIT(&batch);
+    mpsc_init();
+
+    if (max_workers)
+    {
+        int ret = run_pools((unsigned int) max_workers);
+        for (int i = 0; i < MAX_POOLS; ++i)
+        {
+            pool_destroy(&pools[i]);
+        }
+        return ret;
+    }
+
+    for (size_t q = 0; q < sizeof(queues) / sizeof(queues[0]); ++q)
+    {
+        if (only && strcmp(only, queues[q].name) != 0)
+        {
+            continue;
+        }
+        ops = &queues[q];
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a)
+        {
+            if (only_allocator && strcmp(only_allocator, allocators[a].name) != 0)
+            {
+                continue;
+            }
+            allocator = &allocators[a];
+            for (int producers = 1; producers <= max_producers; producers *= 2)
+            {
+                if (run(producers) < 0)
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+
     destroy_task_queues();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,74 +1,568 @@
+/*
+build:
+gcc -O2 -Wall -pthread client.c histogram.c frame.c -o client
+*/
+
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <sys/epoll.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <pthread.h>
 
-#define PORT        9000
-#define BACKLOG     3
-#define POLLSIZE    10
+#include "frame.h"
+#include "histogram.h"
+
+#define PORT            9000
+#define POLLSIZE        256
+#define MAX_PIPELINE    1024
+#define MAX_MESSAGE     (60 * 1024)     // a framed echo has to fit one server read buffer
+
+// a closed-loop load generator for the repo's echo servers. every connection
+// keeps up to pipeline requests in flight and a request is done once as many
+// bytes came back as went out. with a target rate every request has a
+// scheduled start and its latency is taken from that schedule, so a stalled
+// server is charged for the requests it kept from being sent (coordinated
+// omission). the actual send time gives the uncorrected numbers alongside.
+struct options
+{
+    const char * host;
+    int port;
+    unsigned int connections;
+    unsigned int threads;
+    size_t size;
+    unsigned int pipeline;
+    double rate;                // requests/s over all connections, 0 sends as fast as replies allow
+    double duration;
+    double warmup;
+    enum frame_prefix framing;
+    const char * output;
+};
+
+struct request
+{
+    uint64_t intended;          // scheduled start
+    uint64_t sent;              // first byte handed to the kernel
+};
+
+struct connection
+{
+    int fd;
+    int writable;               // waiting for EPOLLOUT with a message half written
+    size_t written;             // bytes of the current message already sent
+    size_t received;            // bytes of the oldest response already read
+    uint64_t next_intended;     // schedule of the next request
+    struct request inflight[MAX_PIPELINE];
+    unsigned int head;
+    unsigned int count;
+};
+
+struct worker
+{
+    pthread_t thread;
+    unsigned int first;
+    unsigned int count;
+    struct connection * conns;
+    struct histogram corrected;
+    struct histogram uncorrected;
+    uint64_t requests;
+    uint64_t errors;
+};
+
+static struct options options;
+static char * message;
+static size_t message_len;
+static uint64_t interval_ns;    // between requests on one connection
+static uint64_t start_ns;
+static uint64_t measure_ns;     // end of the warmup
+static uint64_t end_ns;
 
-pthread_t client;
+void print_help()
+{
+    printf("options\n"
+           "\t -a, --address            server address, 127.0.0.1 by default\n"
+           "\t -p, --port               server port\n"
+           "\t -c, --connections        connections in total\n"
+           "\t -t, --threads            threads the connections are spread over\n"
+           "\t -s, --size               request payload bytes\n"
+           "\t -d, --depth              requests in flight per connection\n"
+           "\t -r, --rate               target requests per second over all connections, 0 is closed loop\n"
+           "\t -D, --duration           seconds measured\n"
+           "\t -w, --warmup             seconds run before measuring\n"
+           "\t -F, --framing            fixed or varint length-prefixed requests for a framing server\n"
+           "\t -o, --output             write the json result to this file instead of stdout\n"
+           );
+}
+
+static struct option long_options[] =
+{
+        {"address", required_argument, 0, 'a'},
+        {"port", required_argument, 0, 'p'},
+        {"connections", required_argument, 0, 'c'},
+        {"threads", required_argument, 0, 't'},
+        {"size", required_argument, 0, 's'},
+        {"depth", required_argument, 0, 'd'},
+        {"rate", required_argument, 0, 'r'},
+        {"duration", required_argument, 0, 'D'},
+        {"warmup", required_argument, 0, 'w'},
+        {"framing", required_argument, 0, 'F'},
+        {"output", required_argument, 0, 'o'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-void * thread_client(void * args)
+static int open_connection(void)
 {
-    puts("client started\n");
-    sleep(1);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host, &address.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", options.host);
+        return -1;
+    }
 
-    int client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0)
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
     {
         perror("client < 0\n");
-        return NULL;
+        return -1;
     }
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_port = htons(PORT);
-    address.sin_addr.s_addr = INADDR_ANY;
-
-    if (connect(client_socket, (struct sockaddr*) &address, sizeof(address)) < 0)
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
     {
         perror("connect client < 0\n");
-        close(client_socket);
-        return NULL;
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void set_interest(int epoll_fd, struct connection * conn, int writable)
+{
+    if (conn->writable == writable)
+    {
+        return;
     }
 
-    char send_buffer[] = "Hello World!";
-    printf("client send %ld\n", send(client_socket, send_buffer, sizeof(send_buffer), 0));
+    struct epoll_event epoll_temp;
+    epoll_temp.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+    epoll_temp.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &epoll_temp);
+    conn->writable = writable;
+}
 
-    char receive_buffer[30];
+// start as many requests as the pipeline and the schedule allow. a message
+// the socket only partly took is finished on EPOLLOUT before the next starts.
+static int send_requests(struct worker * worker, int epoll_fd, struct connection * conn, uint64_t now)
+{
     while (1)
     {
-        ssize_t recv_size = recv(client_socket, receive_buffer, sizeof(receive_buffer) / 2, 0);
-        if (recv_size == 0)
+        if (conn->written == 0)
         {
-            printf("server closed socket\n");
-            break;
+            if (conn->count == options.pipeline || (options.rate > 0 && conn->next_intended > now))
+            {
+                break;
+            }
+
+            struct request * request = &conn->inflight[(conn->head + conn->count) % MAX_PIPELINE];
+            request->intended = options.rate > 0 ? conn->next_intended : now;
+            request->sent = now;
+            conn->next_intended += interval_ns;
+            ++conn->count;
         }
-        else if (recv_size > 0)
+
+        ssize_t sent = send(conn->fd, message + conn->written, message_len - conn->written, MSG_NOSIGNAL);
+        if (sent < 0)
         {
-            printf("server: %*.*s\n", recv_size, recv_size, receive_buffer);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                set_interest(epoll_fd, conn, 1);
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ++worker->errors;
+            return -1;
+        }
+
+        conn->written += sent;
+        if (conn->written < message_len)
+        {
+            set_interest(epoll_fd, conn, 1);
+            return 0;
+        }
+        conn->written = 0;
+    }
+
+    set_interest(epoll_fd, conn, 0);
+    return 0;
+}
+
+static int receive_responses(struct worker * worker, struct connection * conn)
+{
+    static __thread char buffer[64 * 1024];
+
+    while (1)
+    {
+        ssize_t received = recv(conn->fd, buffer, sizeof(buffer), 0);
+        if (received == 0)
+        {
+            ++worker->errors;
+            return -1;
+        }
+        if (received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ++worker->errors;
+            return -1;
+        }
+
+        uint64_t now = now_ns();
+        conn->received += received;
+        while (conn->received >= message_len && conn->count > 0)
+        {
+            struct request * request = &conn->inflight[conn->head];
+            conn->head = (conn->head + 1) % MAX_PIPELINE;
+            --conn->count;
+            conn->received -= message_len;
+
+            if (request->intended >= measure_ns && now <= end_ns)
+            {
+                histogram_record(&worker->corrected, now - request->intended);
+                histogram_record(&worker->uncorrected, now - request->sent);
+                ++worker->requests;
+            }
+        }
+    }
+}
+
+// the next scheduled start over all connections, how long epoll may sleep
+static uint64_t next_due(struct worker * worker)
+{
+    uint64_t due = end_ns;
+    for (unsigned int i = 0; i < worker->count; ++i)
+    {
+        struct connection * conn = &worker->conns[i];
+        if (conn->fd >= 0 && conn->written == 0 && conn->count < options.pipeline && conn->next_intended < due)
+        {
+            due = conn->next_intended;
+        }
+    }
+    return due;
+}
+
+static void * thread_client(void * args)
+{
+    struct worker * worker = args;
+    struct epoll_event events[POLLSIZE];
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1 < 0\n");
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < worker->count; ++i)
+    {
+        struct connection * conn = &worker->conns[i];
+        struct epoll_event epoll_temp;
+
+        // spread the first requests over one interval instead of a burst
+        conn->next_intended = start_ns + interval_ns * (worker->first + i) / options.connections;
+        epoll_temp.events = EPOLLIN;
+        epoll_temp.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &epoll_temp) < 0)
+        {
+            perror("epoll_ctl add client < 0\n");
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    }
+
+    uint64_t now = now_ns();
+    while (now < end_ns)
+    {
+        for (unsigned int i = 0; i < worker->count; ++i)
+        {
+            struct connection * conn = &worker->conns[i];
+            if (conn->fd >= 0 && !conn->writable && send_requests(worker, epoll_fd, conn, now) < 0)
+            {
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+
+        struct timespec timeout = {0, 0};
+        if (options.rate > 0)
+        {
+            uint64_t due = next_due(worker);
+            now = now_ns();
+            if (due > now)
+            {
+                timeout.tv_sec = (due - now) / 1000000000;
+                timeout.tv_nsec = (due - now) % 1000000000;
+            }
         }
         else
         {
-            perror("client read < 0\n");
+            timeout.tv_sec = 1;
         }
+
+        int ready = epoll_pwait2(epoll_fd, events, POLLSIZE, &timeout, NULL);
+        for (int i = 0; i < ready; ++i)
+        {
+            struct connection * conn = events[i].data.ptr;
+            if (conn->fd < 0)
+            {
+                continue;
+            }
+
+            if (((events[i].events & EPOLLIN) && receive_responses(worker, conn) < 0) ||
+                ((events[i].events & EPOLLOUT) && send_requests(worker, epoll_fd, conn, now_ns()) < 0))
+            {
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+
+        now = now_ns();
     }
 
-    close(client_socket);
+    close(epoll_fd);
     return NULL;
 }
 
-int main(int argc, char * argv[])
+static void print_latency(FILE * out, const char * name, const struct histogram * hist, const char * suffix)
 {
-    pthread_create(&client, NULL, thread_client, NULL);
-    pthread_join(client, NULL);
+    fprintf(out, "    \"%s\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+                 "\"p99.9\": %.1f, \"p99.99\": %.1f, \"max\": %.1f}%s\n",
+            name, hist->count ? hist->min / 1e3 : 0.0, histogram_mean(hist) / 1e3,
+            histogram_percentile(hist, 50) / 1e3, histogram_percentile(hist, 90) / 1e3,
+            histogram_percentile(hist, 99) / 1e3, histogram_percentile(hist, 99.9) / 1e3,
+            histogram_percentile(hist, 99.99) / 1e3, hist->max / 1e3, suffix);
+}
+
+static int print_result(struct worker * workers)
+{
+    static struct histogram corrected, uncorrected;
+    uint64_t requests = 0, errors = 0;
+
+    histogram_init(&corrected);
+    histogram_init(&uncorrected);
+    for (unsigned int i = 0; i < options.threads; ++i)
+    {
+        histogram_merge(&corrected, &workers[i].corrected);
+        histogram_merge(&uncorrected, &workers[i].uncorrected);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+    }
+
+    FILE * out = stdout;
+    if (options.output && (out = fopen(options.output, "w")) == NULL)
+    {
+        perror("open output\n");
+        return -1;
+    }
+
+    fprintf(out, "{\n"
+                 "  \"connections\": %u,\n"
+                 "  \"threads\": %u,\n"
+                 "  \"size\": %zu,\n"
+                 "  \"pipeline\": %u,\n"
+                 "  \"target_rate\": %.0f,\n"
+                 "  \"duration_s\": %.3f,\n"
+                 "  \"requests\": %lu,\n"
+                 "  \"errors\": %lu,\n"
+                 "  \"throughput_rps\": %.1f,\n"
+                 "  \"throughput_mbps\": %.3f,\n"
+                 "  \"latency_us\": {\n",
+            options.connections, options.threads, options.size, options.pipeline, options.rate,
+            options.duration, requests, errors, requests / options.duration,
+            requests * message_len * 2 / options.duration / 1e6);
+    print_latency(out, "corrected", &corrected, ",");
+    print_latency(out, "uncorrected", &uncorrected, "");
+    fprintf(out, "  }\n}\n");
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
     return 0;
 }
+
+int main(int argc, char * argv[])
+{
+    int opt;
+
+    options.host = "127.0.0.1";
+    options.port = PORT;
+    options.connections = 1;
+    options.threads = 1;
+    options.size = 64;
+    options.pipeline = 1;
+    options.duration = 10;
+    options.warmup = 1;
+
+    while ((opt = getopt_long(argc, argv, "a:p:c:t:s:d:r:D:w:F:o:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                options.host = optarg;
+                break;
+            case 'p':
+                options.port = atoi(optarg);
+                break;
+            case 'c':
+                options.connections = (unsigned int) atoi(optarg);
+                break;
+            case 't':
+                options.threads = (unsigned int) atoi(optarg);
+                break;
+            case 's':
+                options.size = (size_t) atol(optarg);
+                break;
+            case 'd':
+                options.pipeline = (unsigned int) atoi(optarg);
+                break;
+            case 'r':
+                options.rate = atof(optarg);
+                break;
+            case 'D':
+                options.duration = atof(optarg);
+                break;
+            case 'w':
+                options.warmup = atof(optarg);
+                break;
+            case 'F':
+                if (strcmp(optarg, "fixed") == 0)
+                {
+                    options.framing = FRAME_FIXED;
+                }
+                else if (strcmp(optarg, "varint") == 0)
+                {
+                    options.framing = FRAME_VARINT;
+                }
+                else
+                {
+                    print_help();
+                    return -1;
+                }
+                break;
+            case 'o':
+                options.output = optarg;
+                break;
+            default:
+                print_help();
+                return -1;
+        }
+    }
+
+    if (options.connections == 0 || options.threads == 0 || options.threads > options.connections ||
+        options.pipeline == 0 || options.pipeline > MAX_PIPELINE || options.size == 0 ||
+        options.size > MAX_MESSAGE || options.duration <= 0)
+    {
+        print_help();
+        return -1;
+    }
+
+    // the request goes out as one buffer, framing header included
+    message = malloc(FRAME_HEADER_MAX + options.size);
+    if (message == NULL)
+    {
+        return -1;
+    }
+    message_len = frame_encode(options.framing, message, options.size);
+    memset(message + message_len, 'x', options.size);
+    message_len += options.size;
+
+    interval_ns = options.rate > 0 ? (uint64_t) (1e9 * options.connections / options.rate) : 0;
+
+    struct connection * conns = calloc(options.connections, sizeof(*conns));
+    struct worker * workers = calloc(options.threads, sizeof(*workers));
+    if (conns == NULL || workers == NULL)
+    {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < options.connections; ++i)
+    {
+        conns[i].fd = open_connection();
+        if (conns[i].fd < 0)
+        {
+            return -1;
+        }
+    }
+
+    start_ns = now_ns();
+    measure_ns = start_ns + (uint64_t) (options.warmup * 1e9);
+    end_ns = measure_ns + (uint64_t) (options.duration * 1e9);
+
+    unsigned int first = 0;
+    for (unsigned int i = 0; i < options.threads; ++i)
+    {
+        struct worker * worker = &workers[i];
+        worker->first = first;
+        worker->count = options.connections / options.threads + (i < options.connections % options.threads);
+        worker->conns = conns + first;
+        first += worker->count;
+        histogram_init(&worker->corrected);
+        histogram_init(&worker->uncorrected);
+        pthread_create(&worker->thread, NULL, thread_client, worker);
+    }
+
+    for (unsigned int i = 0; i < options.threads; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    int ret = print_result(workers);
+
+    for (unsigned int i = 0; i < options.connections; ++i)
+    {
+        if (conns[i].fd >= 0)
+        {
+            close(conns[i].fd);
+        }
+    }
+    free(workers);
+    free(conns);
+    free(message);
+    return ret;
+}
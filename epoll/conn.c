@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "conn.h"
+
+static int pool_grow(struct pool * pool)
+{
+    struct slab * slab = malloc(sizeof(struct slab) + pool->slab_count * pool->item_size);
+    if (slab == NULL)
+    {
+        return -1;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    char * items = (char *) (slab + 1);
+    for (size_t i = 0; i < pool->slab_count; ++i)
+    {
+        void ** item = (void **) (items + i * pool->item_size);
+        *item = pool->free;
+        pool->free = item;
+    }
+
+    pool->capacity += pool->slab_count;
+    return 0;
+}
+
+int pool_init(struct pool * pool, size_t item_size, size_t slab_count, size_t prealloc)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->item_size = (item_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pool->slab_count = slab_count;
+
+    while (pool->capacity < prealloc)
+    {
+        if (pool_grow(pool) < 0)
+        {
+            pool_destroy(pool);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void * pool_get(struct pool * pool)
+{
+    if (pool->free == NULL && pool_grow(pool) < 0)
+    {
+        return NULL;
+    }
+
+    void ** item = pool->free;
+    pool->free = *item;
+    ++pool->live;
+    return item;
+}
+
+void pool_put(struct pool * pool, void * item)
+{
+    *(void **) item = pool->free;
+    pool->free = item;
+    --pool->live;
+}
+
+void pool_destroy(struct pool * pool)
+{
+    while (pool->slabs)
+    {
+        struct slab * next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+}
+
+struct conn * conn_get(struct pool * pool)
+{
+    struct conn * conn = pool_get(pool);
+    if (conn)
+    {
+        // the generation survives reuse so old references keep failing
+        uint32_t generation = conn->generation;
+        memset(conn, 0, sizeof(*conn));
+        conn->generation = generation;
+        conn->fd = -1;
+        conn->out_tail = &conn->out_head;
+        conn->zc_tail = &conn->zc_head;
+    }
+
+    return conn;
+}
+
+struct buffer * buffer_get(struct pool * pool)
+{
+    struct buffer * buffer = pool_get(pool);
+    if (buffer)
+    {
+        buffer->next = NULL;
+        buffer->len = 0;
+    }
+
+    return buffer;
+}
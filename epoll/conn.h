@@ -0,0 +1,121 @@
+#ifndef EPOLL_CONN_H
+#define EPOLL_CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "timer-wheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONN_SLAB_COUNT         1024            // connections carved out of one slab allocation
+#define BUFFER_SIZE             (64 * 1024)     // size of one pooled read buffer
+#define BUFFER_SLAB_COUNT       64              // buffers carved out of one slab allocation
+#define SEGMENT_SLAB_COUNT      4096            // output segments carved out of one slab allocation
+
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+enum conn_kind
+{
+    CONN_LISTENER,
+    CONN_CLIENT,
+    CONN_TIMER,
+    CONN_HANDOFF,               // unix socket a successor process connects to for a hot restart
+    CONN_MAILBOX,               // eventfd other threads ring after posting to the reactor
+};
+
+// large fixed-size buffer handed out by the buffer pool
+struct buffer
+{
+    struct buffer * next;       // free list link while pooled
+    size_t len;                 // bytes of valid data starting at data[0]
+    char data[BUFFER_SIZE];
+};
+
+// one chunk of pending output, sent in order and released once fully written
+struct segment
+{
+    struct segment * next;
+    const char * data;          // first unsent byte
+    size_t len;                 // unsent bytes
+    struct buffer * buffer;     // pooled buffer backing data, or NULL for caller-owned memory
+    int busy;                   // handed to the kernel by an async send, must not grow
+    int file_fd;                // >= 0 sends len bytes from this file at file_offset instead of data
+    off_t file_offset;
+    int zerocopy;               // sent with MSG_ZEROCOPY, memory is pinned until the kernel reports it done
+    uint32_t zc_seq;            // last zerocopy send that covered this segment
+};
+
+// per-socket state, registered with epoll through data.ptr
+struct conn
+{
+    int fd;
+    enum conn_kind kind;
+    struct sockaddr_in addr;
+    struct buffer * rbuf;       // read buffer, only held while it has unconsumed bytes
+    struct segment * out_head;  // output queue, flushed with writev style sendmsg
+    struct segment ** out_tail;
+    size_t out_bytes;
+    struct segment * zc_head;   // fully sent zerocopy segments waiting for their completion
+    struct segment ** zc_tail;
+    int zc_enabled;             // SO_ZEROCOPY accepted on the socket
+    uint32_t zc_next;           // id the kernel gives the next MSG_ZEROCOPY send
+    uint32_t events;            // interest currently registered with epoll
+    int paused;                 // reading stopped until output drains below the low-water mark
+    struct timespec accepted;
+    uint64_t last_active;       // wheel tick of the last byte read or written
+    struct timer idle_timer;    // no traffic at all for too long
+    struct timer header_timer;  // first request not received in time
+    struct timer write_timer;   // queued output made no progress in time
+    int ready;                  // queued on the server ready list
+    struct conn * ready_next;
+    unsigned int ops;           // io_uring requests in flight that reference this conn
+    unsigned int sending;       // io_uring sends in flight
+    int reading;                // io_uring multishot recv armed
+    int closing;
+    void * user;                // application state, owned by the handler
+    uint32_t generation;        // bumped on close, tells stale references from other threads apart
+    int flush_queued;           // on the reactor's flush list after posted output
+    uint32_t flush_generation;  // generation it was queued under, a close meanwhile skips the flush
+    struct conn * flush_next;
+    struct conn * live_next;    // open clients, walked to hand them to a successor
+    struct conn ** live_pprev;
+    struct conn * next;         // free list / deferred release link
+};
+
+struct slab
+{
+    struct slab * next;
+};
+
+// free list allocator for fixed-size items that grows a slab at a time and never
+// gives memory back until destroyed, so steady-state get/put never reaches malloc.
+// the first word of a free item holds the free list link.
+struct pool
+{
+    void * free;
+    struct slab * slabs;
+    size_t item_size;
+    size_t slab_count;
+    size_t live;
+    size_t capacity;
+};
+
+int pool_init(struct pool * pool, size_t item_size, size_t slab_count, size_t prealloc);
+void * pool_get(struct pool * pool);
+void pool_put(struct pool * pool, void * item);
+void pool_destroy(struct pool * pool);
+
+struct conn * conn_get(struct pool * pool);
+struct buffer * buffer_get(struct pool * pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EPOLL_CONN_H
@@ -0,0 +1,88 @@
+/*
+build:
+gcc -O2 -Wall -pthread -I.. -c server.c conn.c timer-wheel.c frame.c handoff.c mailbox.c workers.c uring.c udp.c ../ringlog.c
+g++ -std=c++20 -O2 -Wall -pthread coro-echo.cpp coro.cpp server.o conn.o timer-wheel.o frame.o handoff.o mailbox.o workers.o uring.o udp.o ringlog.o -o coro-echo
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include "coro.hpp"
+
+#define LINE_MAX_LEN    256
+
+// a line protocol written as one coroutine per client: greet, then answer
+// every line. "sleep <ms>" waits before answering, "quit" ends the session.
+static coro::task session(coro::stream client)
+{
+    static const char greeting[] = "hello, lines are echoed, sleep <ms> waits, quit closes\n";
+    char line[LINE_MAX_LEN];
+    size_t len = 0;
+
+    if (!co_await client.write(greeting, sizeof(greeting) - 1))
+    {
+        co_return;
+    }
+
+    while (true)
+    {
+        size_t read = co_await client.read(line + len, sizeof(line) - len);
+        if (read == 0)
+        {
+            co_return;
+        }
+        len += read;
+
+        char * end;
+        while ((end = static_cast<char *>(memchr(line, '\n', len))) != nullptr)
+        {
+            size_t size = end - line + 1;
+
+            if (size >= 5 && strncmp(line, "quit", 4) == 0)
+            {
+                co_await client.write("bye\n", 4);
+                co_return;
+            }
+
+            if (size > 6 && strncmp(line, "sleep ", 6) == 0)
+            {
+                co_await coro::sleep(atoi(line + 6));
+                if (!co_await client.write("slept\n", 6))
+                {
+                    co_return;
+                }
+            }
+            else if (!co_await client.write(line, size))
+            {
+                co_return;
+            }
+
+            memmove(line, line + size, len - size);
+            len -= size;
+        }
+
+        if (len == sizeof(line))
+        {
+            co_await client.write("line too long\n", 14);
+            co_return;
+        }
+    }
+}
+
+static coro::task acceptor()
+{
+    while (true)
+    {
+        coro::stream client = co_await coro::accept();
+        session(std::move(client));
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    // parks on accept() until the reactor hands over the first client
+    acceptor();
+    return server_main(argc, argv, &coro::reactor_handler);
+}
@@ -0,0 +1,394 @@
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#include <sys/socket.h>
+
+#include "coro.hpp"
+
+#define FRAME_CLASSES           6               // 128 bytes up to 4 KiB, doubling
+#define FRAME_MIN_SHIFT         7
+#define FRAME_SLAB_COUNT        256
+#define SESSION_SLAB_COUNT      1024
+
+namespace coro
+{
+
+// coroutine state of one client, reached through conn->user. it outlives
+// whichever of the connection and the stream goes first.
+struct session
+{
+    struct conn * conn;
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+    const char * data;          // bytes offered by on_data while a reader runs
+    std::size_t len;
+    bool in_data;               // inside on_data, the reactor consumes and flushes afterwards
+    bool in_drain;              // inside on_drain, the flush in progress sends what is queued
+    bool owned;                 // a stream refers to it
+    bool finished;              // the stream is gone, shut down once the output is out
+    bool closed;                // the connection is gone
+    session * next;             // not yet accepted
+};
+
+static struct pool frame_pools[FRAME_CLASSES];
+static struct pool session_pool;
+static bool pools_ready;
+
+static session * pending;       // accepted, waiting for accept()
+static session ** pending_tail = &pending;
+static accept_awaiter * acceptors;
+
+static void init_pools()
+{
+    for (int i = 0; i < FRAME_CLASSES; ++i)
+    {
+        if (pool_init(&frame_pools[i], std::size_t(1) << (FRAME_MIN_SHIFT + i), FRAME_SLAB_COUNT, 0) < 0)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    if (pool_init(&session_pool, sizeof(session), SESSION_SLAB_COUNT, 0) < 0)
+    {
+        throw std::bad_alloc();
+    }
+    pools_ready = true;
+}
+
+static int frame_class(std::size_t size)
+{
+    int index = 0;
+    while (index < FRAME_CLASSES && (std::size_t(1) << (FRAME_MIN_SHIFT + index)) < size)
+    {
+        ++index;
+    }
+    return index;
+}
+
+void * frame_alloc(std::size_t size)
+{
+    if (!pools_ready)
+    {
+        init_pools();
+    }
+
+    int index = frame_class(size);
+    if (index == FRAME_CLASSES)
+    {
+        return ::operator new(size);
+    }
+
+    void * frame = pool_get(&frame_pools[index]);
+    if (frame == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return frame;
+}
+
+void frame_free(void * frame, std::size_t size)
+{
+    int index = frame_class(size);
+    if (index == FRAME_CLASSES)
+    {
+        ::operator delete(frame);
+        return;
+    }
+
+    pool_put(&frame_pools[index], frame);
+}
+
+// everything queued has left, a finished stream can let the peer go. the
+// reactor sees the hangup and closes the connection through its usual path.
+static void shutdown_finished(session * s)
+{
+    if (s->finished && !s->closed && s->conn->out_bytes == 0)
+    {
+        shutdown(s->conn->fd, SHUT_RDWR);
+    }
+}
+
+stream::~stream()
+{
+    if (s_ == nullptr)
+    {
+        return;
+    }
+
+    s_->owned = false;
+    if (s_->closed)
+    {
+        pool_put(&session_pool, s_);
+        return;
+    }
+
+    s_->finished = true;
+    shutdown_finished(s_);
+}
+
+bool stream::open() const noexcept
+{
+    return s_ && !s_->closed;
+}
+
+struct conn * stream::conn() const noexcept
+{
+    return s_ && !s_->closed ? s_->conn : nullptr;
+}
+
+// bytes come from the view on_data is offering, or outside on_data from what
+// an earlier on_data left in the read buffer
+bool read_awaiter::await_ready() noexcept
+{
+    if (s == nullptr || s->closed || s->len > 0)
+    {
+        return true;
+    }
+
+    return !s->in_data && s->conn->rbuf && s->conn->rbuf->len > 0;
+}
+
+void read_awaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    s->reader = handle;
+}
+
+std::size_t read_awaiter::await_resume() noexcept
+{
+    if (s == nullptr || s->closed)
+    {
+        return 0;
+    }
+
+    if (s->len > 0)
+    {
+        std::size_t n = len < s->len ? len : s->len;
+        std::memcpy(data, s->data, n);
+        s->data += n;
+        s->len -= n;
+        return n;
+    }
+
+    struct buffer * rbuf = s->conn->rbuf;
+    if (!s->in_data && rbuf && rbuf->len > 0)
+    {
+        std::size_t n = len < rbuf->len ? len : rbuf->len;
+        std::memcpy(data, rbuf->data, n);
+        std::memmove(rbuf->data, rbuf->data + n, rbuf->len - n);
+        rbuf->len -= n;
+        if (rbuf->len == 0)
+        {
+            pool_put(&buffer_pool, rbuf);
+            s->conn->rbuf = NULL;
+        }
+        return n;
+    }
+
+    return 0;
+}
+
+// output is queued at once. outside the reactor callbacks that flush anyway
+// it is flushed right here, which may find the peer gone. inside on_data the
+// write never suspends: the bytes on offer are consumed in full and the
+// reactor's high-water pause stops reading until the output drains, the same
+// as for a plain callback handler.
+bool write_awaiter::await_ready() noexcept
+{
+    if (s == nullptr || s->closed)
+    {
+        return true;
+    }
+
+    if (conn_send(s->conn, data, len) < 0)
+    {
+        fprintf(stderr, "no output buffer for client %d\n", s->conn->fd);
+        return true;
+    }
+    queued = true;
+
+    if (s->in_data)
+    {
+        return true;
+    }
+
+    if (!s->in_drain)
+    {
+        backend->flush(s->conn);
+    }
+
+    return s->closed || s->conn->out_bytes < config.high_water;
+}
+
+void write_awaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    s->writer = handle;
+}
+
+bool write_awaiter::await_resume() noexcept
+{
+    return queued && !s->closed;
+}
+
+bool accept_awaiter::await_ready() noexcept
+{
+    if (pending == nullptr)
+    {
+        return false;
+    }
+
+    s = pending;
+    pending = s->next;
+    if (pending == nullptr)
+    {
+        pending_tail = &pending;
+    }
+    s->owned = true;
+    return true;
+}
+
+void accept_awaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    handle = h;
+    next = acceptors;
+    acceptors = this;
+}
+
+static void sleep_expired(struct timer_wheel * wheel, struct timer * timer)
+{
+    (void) wheel;
+    // the awaiter sits in the suspended frame
+    container_of(timer, sleep_awaiter, timer)->handle.resume();
+}
+
+void sleep_awaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    handle = h;
+    timer_init(&timer, sleep_expired);
+    timer_arm(&wheel, &timer, ms_to_ticks(ms));
+}
+
+static void on_open(struct conn * conn)
+{
+    session * s = static_cast<session *>(pool_get(&session_pool));
+    if (s == nullptr)
+    {
+        fprintf(stderr, "no session for client %d\n", conn->fd);
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+
+    *s = session{};
+    s->conn = conn;
+    conn->user = s;
+
+    if (acceptors)
+    {
+        accept_awaiter * acceptor = acceptors;
+        acceptors = acceptor->next;
+        acceptor->s = s;
+        s->owned = true;
+        acceptor->handle.resume();
+        return;
+    }
+
+    *pending_tail = s;
+    pending_tail = &s->next;
+}
+
+static ssize_t on_data(struct conn * conn, const char * data, size_t len)
+{
+    session * s = static_cast<session *>(conn->user);
+    if (s == nullptr || s->finished)
+    {
+        return len;
+    }
+
+    // nobody is reading right now, the bytes wait in the read buffer
+    if (!s->reader)
+    {
+        return 0;
+    }
+
+    s->data = data;
+    s->len = len;
+    s->in_data = true;
+    std::exchange(s->reader, nullptr).resume();
+    s->in_data = false;
+
+    size_t used = len - s->len;
+    s->data = nullptr;
+    s->len = 0;
+    return used;
+}
+
+static void on_drain(struct conn * conn)
+{
+    session * s = static_cast<session *>(conn->user);
+    if (s == nullptr)
+    {
+        return;
+    }
+
+    if (s->writer && conn->out_bytes < config.high_water)
+    {
+        s->in_drain = true;
+        std::exchange(s->writer, nullptr).resume();
+        s->in_drain = false;
+    }
+
+    shutdown_finished(s);
+}
+
+static void on_close(struct conn * conn)
+{
+    session * s = static_cast<session *>(conn->user);
+    if (s == nullptr)
+    {
+        return;
+    }
+
+    conn->user = nullptr;
+    s->closed = true;
+
+    if (!s->owned)
+    {
+        // never accepted or already dropped by its stream
+        for (session ** link = &pending; *link; link = &(*link)->next)
+        {
+            if (*link == s)
+            {
+                *link = s->next;
+                if (*link == nullptr)
+                {
+                    pending_tail = link;
+                }
+                break;
+            }
+        }
+        pool_put(&session_pool, s);
+        return;
+    }
+
+    // the waiting coroutine sees the stream closed, s may be gone afterwards
+    if (s->reader)
+    {
+        std::exchange(s->reader, nullptr).resume();
+    }
+    else if (s->writer)
+    {
+        std::exchange(s->writer, nullptr).resume();
+    }
+}
+
+const struct handler reactor_handler =
+{
+    .on_open = on_open,
+    .on_data = on_data,
+    .on_frame = nullptr,
+    .on_drain = on_drain,
+    .on_close = on_close,
+};
+
+} // namespace coro
@@ -0,0 +1,127 @@
+#ifndef EPOLL_CORO_HPP
+#define EPOLL_CORO_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+
+#include "server.h"
+
+// C++20 coroutines on top of the reactor. handlers are written as straight-line
+// code against awaitable read, write, accept and sleep, the reactor callbacks
+// resume them in place on the event loop thread. frames come from size-class
+// pools and every awaiter lives inside the frame, so steady state awaiting
+// never reaches the heap. input that arrives while a coroutine is not reading
+// waits in the connection's read buffer, a client may run at most one buffer
+// ahead of it.
+namespace coro
+{
+
+void * frame_alloc(std::size_t size);
+void frame_free(void * frame, std::size_t size);
+
+// detached coroutine: runs as soon as it is called and frees its own frame
+// when it returns
+struct task
+{
+    struct promise_type
+    {
+        static void * operator new(std::size_t size) { return frame_alloc(size); }
+        static void operator delete(void * frame, std::size_t size) { frame_free(frame, size); }
+
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+struct session;
+
+struct read_awaiter
+{
+    session * s;
+    char * data;
+    std::size_t len;
+
+    bool await_ready() noexcept;
+    void await_suspend(std::coroutine_handle<> handle) noexcept;
+    std::size_t await_resume() noexcept;
+};
+
+struct write_awaiter
+{
+    session * s;
+    const char * data;
+    std::size_t len;
+    bool queued;
+
+    bool await_ready() noexcept;
+    void await_suspend(std::coroutine_handle<> handle) noexcept;
+    bool await_resume() noexcept;
+};
+
+// one client, owned by the coroutine serving it. when the stream goes away
+// the connection is shut down as soon as its queued output has been sent.
+class stream
+{
+public:
+    explicit stream(session * s = nullptr) noexcept : s_(s) {}
+    stream(stream && other) noexcept : s_(other.s_) { other.s_ = nullptr; }
+    stream(const stream &) = delete;
+    stream & operator=(const stream &) = delete;
+    ~stream();
+
+    // false once the peer is gone
+    bool open() const noexcept;
+    struct conn * conn() const noexcept;
+
+    // copy up to len received bytes into data, 0 once the peer is gone
+    read_awaiter read(char * data, std::size_t len) noexcept { return {s_, data, len}; }
+
+    // queue len bytes and suspend while the client is above the high-water
+    // mark, false once the peer is gone
+    write_awaiter write(const void * data, std::size_t len) noexcept
+    {
+        return {s_, static_cast<const char *>(data), len, false};
+    }
+
+private:
+    session * s_;
+};
+
+// the next accepted client
+struct accept_awaiter
+{
+    session * s;
+    std::coroutine_handle<> handle;
+    accept_awaiter * next;
+
+    bool await_ready() noexcept;
+    void await_suspend(std::coroutine_handle<> handle) noexcept;
+    stream await_resume() noexcept { return stream(s); }
+};
+
+inline accept_awaiter accept() noexcept { return {nullptr, {}, nullptr}; }
+
+// resume after ms on the reactor's timer wheel, at tick resolution
+struct sleep_awaiter
+{
+    struct timer timer;
+    unsigned int ms;
+    std::coroutine_handle<> handle;
+
+    bool await_ready() const noexcept { return ms == 0; }
+    void await_suspend(std::coroutine_handle<> handle) noexcept;
+    void await_resume() const noexcept {}
+};
+
+inline sleep_awaiter sleep(unsigned int ms) noexcept { return {{}, ms, {}}; }
+
+// pass to server_main, clients are handed out through accept()
+extern const struct handler reactor_handler;
+
+} // namespace coro
+
+#endif // EPOLL_CORO_HPP
@@ -0,0 +1,76 @@
+#include "frame.h"
+
+static int varint_header(const unsigned char * data, size_t len, size_t * body)
+{
+    uint32_t value = 0;
+
+    for (size_t i = 0; i < FRAME_VARINT_MAX; ++i)
+    {
+        if (i == len)
+        {
+            return 0;
+        }
+
+        // the last byte only has room for what is left of 32 bits, more
+        // would wrap instead of failing
+        if (7 * i + 7 > 32 && (data[i] & 0x7f) >> (32 - 7 * i))
+        {
+            return -1;
+        }
+
+        value |= (uint32_t) (data[i] & 0x7f) << (7 * i);
+        if ((data[i] & 0x80) == 0)
+        {
+            *body = value;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+int frame_header(enum frame_prefix prefix, const char * data, size_t len, size_t * body)
+{
+    const unsigned char * bytes = (const unsigned char *) data;
+
+    switch (prefix)
+    {
+        case FRAME_FIXED:
+            if (len < FRAME_FIXED_SIZE)
+            {
+                return 0;
+            }
+            *body = (size_t) bytes[0] << 24 | (size_t) bytes[1] << 16 | (size_t) bytes[2] << 8 | bytes[3];
+            return FRAME_FIXED_SIZE;
+        case FRAME_VARINT:
+            return varint_header(bytes, len, body);
+        default:
+            return -1;
+    }
+}
+
+size_t frame_encode(enum frame_prefix prefix, char * out, size_t len)
+{
+    unsigned char * bytes = (unsigned char *) out;
+    size_t size = 0;
+
+    switch (prefix)
+    {
+        case FRAME_FIXED:
+            bytes[0] = len >> 24;
+            bytes[1] = len >> 16;
+            bytes[2] = len >> 8;
+            bytes[3] = len;
+            return FRAME_FIXED_SIZE;
+        case FRAME_VARINT:
+            do
+            {
+                bytes[size] = (len & 0x7f) | (len > 0x7f ? 0x80 : 0);
+                len >>= 7;
+            }
+            while (bytes[size++] & 0x80);
+            return size;
+        default:
+            return 0;
+    }
+}
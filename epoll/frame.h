@@ -0,0 +1,34 @@
+#ifndef EPOLL_FRAME_H
+#define EPOLL_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FRAME_FIXED_SIZE        4       // big-endian uint32 length
+#define FRAME_VARINT_MAX        5       // LEB128 covers 32 bit lengths in 5 bytes
+#define FRAME_HEADER_MAX        FRAME_VARINT_MAX
+
+enum frame_prefix
+{
+    FRAME_NONE,                 // raw byte stream, no framing
+    FRAME_FIXED,
+    FRAME_VARINT,
+};
+
+// decode the length prefix at data. returns the header size and stores the
+// body length, 0 when more bytes are needed, -1 for a malformed prefix.
+int frame_header(enum frame_prefix prefix, const char * data, size_t len, size_t * body);
+
+// encode the prefix for a body of len bytes into out, FRAME_HEADER_MAX bytes
+// are always enough. returns the header size.
+size_t frame_encode(enum frame_prefix prefix, char * out, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EPOLL_FRAME_H
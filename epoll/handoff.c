@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "conn.h"
+#include "server.h"
+
+#define HANDOFF_TIMEOUT_S       5       // a stuck peer must not hang the reactor for longer
+#define HANDOFF_CHUNK           (16 * 1024)
+
+enum handoff_type
+{
+    HANDOFF_LISTENER = 1,
+    HANDOFF_CLIENT,
+    HANDOFF_DONE,
+};
+
+// one record on the unix socket, followed by input then output bytes. the fd
+// rides along as SCM_RIGHTS ancillary data.
+struct handoff_record
+{
+    uint32_t type;
+    uint32_t input;             // received bytes the handler has not consumed yet
+    uint32_t output;            // queued bytes not sent yet
+    struct sockaddr_in addr;
+};
+
+static int write_all(int sock, const void * data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = write(sock, data, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        data = (const char *) data + ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int read_all(int sock, void * data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = read(sock, data, len);
+        if (ret <= 0)
+        {
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        data = (char *) data + ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int send_record(int sock, const struct handoff_record * record, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {(void *) record, sizeof(*record)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*record) ? 0 : -1;
+}
+
+static int recv_record(int sock, struct handoff_record * record, int * fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {record, sizeof(*record)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(*record))
+    {
+        return -1;
+    }
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return 0;
+}
+
+static int unix_address(const char * path, struct sockaddr_un * address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        fprintf(stderr, "handoff path %s too long\n", path);
+        return -1;
+    }
+
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char * path)
+{
+    struct sockaddr_un address;
+    if (unix_address(path, &address) < 0)
+    {
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("handoff socket < 0\n");
+        return -1;
+    }
+
+    // a predecessor's name is stale once its listener has been taken over
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(sock, 1) < 0)
+    {
+        perror("handoff bind < 0\n");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// file and zerocopy segments point at memory or files of this process and
+// uring sends may still be in flight, such clients drain here instead. so do
+// clients with more output queued than a record can describe.
+static int can_hand_off(struct conn * conn)
+{
+    if (conn->out_bytes > UINT32_MAX)
+    {
+        return 0;
+    }
+
+    for (struct segment * segment = conn->out_head; segment; segment = segment->next)
+    {
+        if (segment->file_fd >= 0 || segment->zerocopy || segment->busy)
+        {
+            return 0;
+        }
+    }
+
+    return conn->zc_head == NULL;
+}
+
+static int send_client(int sock, struct conn * conn)
+{
+    struct handoff_record record = {0};
+    record.type = HANDOFF_CLIENT;
+    record.input = conn->rbuf ? conn->rbuf->len : 0;
+    record.output = conn->out_bytes;
+    record.addr = conn->addr;
+
+    if (send_record(sock, &record, conn->fd) < 0 ||
+        (record.input && write_all(sock, conn->rbuf->data, record.input) < 0))
+    {
+        return -1;
+    }
+
+    for (struct segment * segment = conn->out_head; segment; segment = segment->next)
+    {
+        if (write_all(sock, segment->data, segment->len) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// old side: a successor connected to the handoff socket. it gets the listener
+// first so it can start accepting right away, then optionally every client
+// that can move together with its buffered input and output. the socket
+// stays open in the kernel throughout, so no connection attempt is refused.
+// it runs on the reactor and blocks it: every read or write may take up to
+// HANDOFF_TIMEOUT_S, and all queued output is copied over the socket, so no
+// client is served until the handoff is done or the successor times out.
+int handoff_serve(int unix_listener, int listener)
+{
+    int sock = accept4(unix_listener, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            perror("handoff accept < 0\n");
+        }
+        return -1;
+    }
+
+    struct timeval timeout = {HANDOFF_TIMEOUT_S, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char want_clients;
+    struct handoff_record record = {0};
+    record.type = HANDOFF_LISTENER;
+    if (read_all(sock, &want_clients, 1) < 0 || send_record(sock, &record, listener) < 0)
+    {
+        perror("handoff listener\n");
+        close(sock);
+        return -1;
+    }
+
+    unsigned long moved = 0;
+    struct conn * next;
+    for (struct conn * conn = want_clients ? live_conns : NULL; conn; conn = next)
+    {
+        next = conn->live_next;
+        if (conn->closing || !can_hand_off(conn))
+        {
+            continue;
+        }
+
+        if (send_client(sock, conn) < 0)
+        {
+            perror("handoff client\n");
+            break;
+        }
+
+        // the successor holds its own reference now, closing ours leaves the
+        // connection alone
+        backend->close(conn);
+        ++moved;
+    }
+
+    record.type = HANDOFF_DONE;
+    send_record(sock, &record, -1);
+    close(sock);
+
+    stats.handoffs += moved;
+    printf("handed off listener and %lu clients, draining %lu\n", moved, stats.clients);
+    return 0;
+}
+
+static int skip_all(int sock, size_t len)
+{
+    char chunk[HANDOFF_CHUNK];
+    while (len > 0)
+    {
+        size_t part = len < sizeof(chunk) ? len : sizeof(chunk);
+        if (read_all(sock, chunk, part) < 0)
+        {
+            return -1;
+        }
+        len -= part;
+    }
+
+    return 0;
+}
+
+// a client that cannot be adopted is closed and the rest of its bytes are
+// skipped, so the records behind it still come through. -1 only when the
+// socket itself failed and nothing after this record can be read.
+static int adopt_client(int sock, const struct handoff_record * record, int fd, struct conn ** adopted)
+{
+    char chunk[HANDOFF_CHUNK];
+    uint32_t input = record->input;
+    uint32_t left = record->output;
+    int ret = 0;
+
+    *adopted = NULL;
+    struct conn * conn = conn_get(&conn_pool);
+    if (conn == NULL)
+    {
+        goto fail;
+    }
+
+    conn->fd = fd;
+    conn->addr = record->addr;
+
+    if (input)
+    {
+        conn->rbuf = buffer_get(&buffer_pool);
+        if (conn->rbuf == NULL || input > BUFFER_SIZE)
+        {
+            goto fail;
+        }
+        if (read_all(sock, conn->rbuf->data, input) < 0)
+        {
+            ret = -1;
+            goto fail;
+        }
+        conn->rbuf->len = input;
+        input = 0;
+    }
+
+    while (left > 0)
+    {
+        size_t len = left < sizeof(chunk) ? left : sizeof(chunk);
+        if (read_all(sock, chunk, len) < 0)
+        {
+            ret = -1;
+            goto fail;
+        }
+        left -= len;
+        if (conn_send(conn, chunk, len) < 0)
+        {
+            goto fail;
+        }
+    }
+
+    *adopted = conn;
+    return 0;
+
+fail:
+    fprintf(stderr, "handoff of client %d failed\n", fd);
+    close(fd);
+    if (conn)
+    {
+        conn_free_buffers(conn);
+        pool_put(&conn_pool, conn);
+    }
+    return ret < 0 ? -1 : skip_all(sock, (size_t) input + left);
+}
+
+// new side: take the listener, and the clients when asked for, from a running
+// predecessor. returns the listener fd, or -1 when nobody is listening on path.
+// adopted clients come back linked through conn->next for the reactor.
+int handoff_takeover(const char * path, int want_clients, struct conn ** adopted)
+{
+    struct sockaddr_un address;
+    *adopted = NULL;
+    if (unix_address(path, &address) < 0)
+    {
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("handoff socket < 0\n");
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    char request = want_clients != 0;
+    struct handoff_record record;
+    int listener;
+    if (write_all(sock, &request, 1) < 0 || recv_record(sock, &record, &listener) < 0 ||
+        record.type != HANDOFF_LISTENER || listener < 0)
+    {
+        fprintf(stderr, "handoff from %s failed\n", path);
+        close(sock);
+        return -1;
+    }
+
+    // the predecessor already let go of every client it sent, so read on to
+    // HANDOFF_DONE whatever happens to one of them
+    struct conn ** tail = adopted;
+    unsigned long taken = 0, failed = 0;
+    int fd, done = 0;
+    while (recv_record(sock, &record, &fd) == 0)
+    {
+        if (record.type != HANDOFF_CLIENT)
+        {
+            done = record.type == HANDOFF_DONE;
+            break;
+        }
+
+        // no fd when ours ran out and the kernel truncated the control data
+        struct conn * conn = NULL;
+        int ret = fd < 0 ? skip_all(sock, (size_t) record.input + record.output)
+                         : adopt_client(sock, &record, fd, &conn);
+        if (conn)
+        {
+            *tail = conn;
+            tail = &conn->next;
+            ++taken;
+        }
+        else
+        {
+            ++failed;
+        }
+
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+
+    close(sock);
+    stats.handoffs += taken;
+    stats.handoff_failures += failed;
+    printf("took over listener and %lu clients from %s, %lu failed%s\n", taken, path, failed,
+           done ? "" : ", handoff cut short");
+    return listener;
+}
@@ -0,0 +1,104 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static size_t value_index(uint64_t value)
+{
+    if (value >= (1ULL << HIST_MAX_BITS))
+    {
+        value = (1ULL << HIST_MAX_BITS) - 1;
+    }
+
+    if (value < HIST_SUB_COUNT)
+    {
+        return value;
+    }
+
+    // shift so the value lands in the upper half of the sub-bucket range
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return (size_t) (shift + 1) * HIST_HALF_COUNT + (value >> shift) - HIST_HALF_COUNT;
+}
+
+static uint64_t highest_equivalent(size_t index)
+{
+    if (index < HIST_SUB_COUNT)
+    {
+        return index;
+    }
+
+    int shift = index / HIST_HALF_COUNT - 1;
+    uint64_t sub = index % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_init(struct histogram * hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram * hist, uint64_t value)
+{
+    ++hist->counts[value_index(value)];
+    ++hist->count;
+    hist->sum += value;
+    if (value < hist->min)
+    {
+        hist->min = value;
+    }
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+void histogram_merge(struct histogram * dst, const struct histogram * src)
+{
+    for (size_t i = 0; i < HIST_COUNTS; ++i)
+    {
+        dst->counts[i] += src->counts[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+    {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+}
+
+uint64_t histogram_percentile(const struct histogram * hist, double percentile)
+{
+    if (hist->count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * hist->count + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_COUNTS; ++i)
+    {
+        seen += hist->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = highest_equivalent(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+double histogram_mean(const struct histogram * hist)
+{
+    return hist->count ? hist->sum / hist->count : 0.0;
+}
@@ -0,0 +1,42 @@
+#ifndef EPOLL_HISTOGRAM_H
+#define EPOLL_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIST_SUB_BITS           11              // 2048 linear sub-buckets, 3 significant digits
+#define HIST_SUB_COUNT          (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT         (HIST_SUB_COUNT / 2)
+#define HIST_MAX_BITS           40              // values up to 2^40, 18 minutes in ns
+#define HIST_COUNTS             ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF_COUNT)
+
+// high dynamic range histogram: values below HIST_SUB_COUNT are counted
+// exactly, above that every power of two range is split into HIST_HALF_COUNT
+// linear buckets, so any recorded value is known to within 1/1024 of itself.
+// recording is an index computation and an increment.
+struct histogram
+{
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t counts[HIST_COUNTS];
+};
+
+void histogram_init(struct histogram * hist);
+void histogram_record(struct histogram * hist, uint64_t value);
+void histogram_merge(struct histogram * dst, const struct histogram * src);
+// highest value equivalent to the one at or below which percentile of the
+// recorded values lie, 0 when empty
+uint64_t histogram_percentile(const struct histogram * hist, double percentile);
+double histogram_mean(const struct histogram * hist);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EPOLL_HISTOGRAM_H
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+#define HISTORY_MAGIC   0x3159524f54534948ULL  // "HISTORY1"
+#define PAD             UINT32_MAX              // rest of the lap is unused
+
+static uint64_t record_size(size_t len)
+{
+    return sizeof(uint32_t) + ((len + 3) & ~(uint64_t) 3);
+}
+
+static uint32_t length_at(const struct history * history, uint64_t offset)
+{
+    uint32_t len;
+    memcpy(&len, history->data + offset % history->capacity, sizeof(len));
+    return len;
+}
+
+// step over a pad marker to the start of the next lap
+static uint64_t skip_pad(const struct history * history, uint64_t offset)
+{
+    if (offset != history->header->tail && length_at(history, offset) == PAD)
+    {
+        offset += history->capacity - offset % history->capacity;
+    }
+    return offset;
+}
+
+static uint64_t next_record(const struct history * history, uint64_t offset)
+{
+    offset += record_size(length_at(history, offset));
+    return skip_pad(history, offset);
+}
+
+static void index_add(struct history * history, uint64_t offset)
+{
+    if (history->records++ % HISTORY_INDEX_EVERY)
+    {
+        return;
+    }
+
+    // the oldest entry is of an evicted record by the time the ring is full
+    if (history->index_last - history->index_first == history->index_size)
+    {
+        ++history->index_first;
+    }
+    history->index[history->index_last++ % history->index_size] = offset;
+}
+
+// walk head to tail once, cut the ring at the first record that does not
+// fit where it is and index the ones before it
+static void recover(struct history * history, const char * path)
+{
+    struct history_header * header = history->header;
+    uint64_t at = header->head;
+    while (at != header->tail)
+    {
+        uint32_t len = length_at(history, at);
+        uint64_t left = history->capacity - at % history->capacity;
+        uint64_t next = len == PAD ? at + left : at + record_size(len);
+        if (next > header->tail || (len != PAD && (next - at > history->capacity / 2 || next - at > left)))
+        {
+            fprintf(stderr, "history %s cut at %lu, %lu bytes dropped\n", path, (unsigned long) at,
+                    (unsigned long) (header->tail - at));
+            header->tail = at;
+            break;
+        }
+
+        if (len != PAD)
+        {
+            index_add(history, at);
+        }
+        at = next;
+    }
+}
+
+static void * sync_thread(void * args)
+{
+    struct history * history = args;
+
+    while (!__atomic_load_n(&history->stop, __ATOMIC_RELAXED))
+    {
+        sleep(history->sync_interval);
+        if (msync(history->header, HISTORY_HEADER_SIZE + history->capacity, MS_SYNC) < 0)
+        {
+            perror("msync history\n");
+        }
+    }
+
+    return NULL;
+}
+
+int history_open(struct history * history, const char * path, uint64_t capacity, unsigned int sync_interval)
+{
+    memset(history, 0, sizeof(*history));
+    history->capacity = (capacity + 3) & ~(uint64_t) 3;
+    history->sync_interval = sync_interval;
+
+    history->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (history->fd < 0)
+    {
+        perror("open history\n");
+        return -1;
+    }
+
+    size_t size = HISTORY_HEADER_SIZE + history->capacity;
+    struct stat st;
+    if (fstat(history->fd, &st) < 0 || ((size_t) st.st_size != size && ftruncate(history->fd, size) < 0))
+    {
+        perror("size history\n");
+        close(history->fd);
+        return -1;
+    }
+
+    void * map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, history->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap history\n");
+        close(history->fd);
+        return -1;
+    }
+
+    history->header = map;
+    history->data = (char *) map + HISTORY_HEADER_SIZE;
+
+    // the most records the ring can hold are empty ones of 4 bytes
+    history->index_size = history->capacity / (sizeof(uint32_t) * HISTORY_INDEX_EVERY) + 2;
+    history->index = malloc(history->index_size * sizeof(*history->index));
+    if (history->index == NULL)
+    {
+        perror("history index\n");
+        munmap(map, size);
+        close(history->fd);
+        return -1;
+    }
+
+    struct history_header * header = history->header;
+    if (header->magic != HISTORY_MAGIC || header->capacity != history->capacity ||
+        header->head > header->tail || header->tail - header->head > history->capacity ||
+        header->head % sizeof(uint32_t) || header->tail % sizeof(uint32_t))
+    {
+        header->magic = HISTORY_MAGIC;
+        header->capacity = history->capacity;
+        header->head = 0;
+        header->tail = 0;
+    }
+    recover(history, path);
+
+    pthread_mutex_init(&history->lock, NULL);
+    if (sync_interval && pthread_create(&history->sync_thread, NULL, sync_thread, history) != 0)
+    {
+        history->sync_interval = 0;
+    }
+
+    return 0;
+}
+
+void history_close(struct history * history)
+{
+    if (history->sync_interval)
+    {
+        __atomic_store_n(&history->stop, 1, __ATOMIC_RELAXED);
+        pthread_join(history->sync_thread, NULL);
+    }
+
+    msync(history->header, HISTORY_HEADER_SIZE + history->capacity, MS_SYNC);
+    munmap(history->header, HISTORY_HEADER_SIZE + history->capacity);
+    close(history->fd);
+    free(history->index);
+    pthread_mutex_destroy(&history->lock);
+}
+
+int history_append(struct history * history, const char * data, size_t len)
+{
+    uint64_t size = record_size(len);
+    if (size > history->capacity / 2)
+    {
+        return -1;
+    }
+
+    history_lock(history);
+
+    struct history_header * header = history->header;
+    uint64_t start = header->tail;
+    uint64_t left = history->capacity - start % history->capacity;
+    if (size > left)
+    {
+        start += left;          // does not fit the rest of the lap
+    }
+
+    // evict until the new record and a possible pad lie within one capacity of head
+    while (start + size - header->head > history->capacity)
+    {
+        header->head = next_record(history, header->head);
+    }
+    if (header->head == header->tail)
+    {
+        header->head = start;   // everything evicted, never leave head on the pad
+    }
+
+    if (start != header->tail)
+    {
+        uint32_t pad = PAD;
+        memcpy(history->data + header->tail % history->capacity, &pad, sizeof(pad));
+    }
+
+    uint32_t len32 = (uint32_t) len;
+    char * record = history->data + start % history->capacity;
+    memcpy(record + sizeof(len32), data, len);
+    memcpy(record, &len32, sizeof(len32));
+    header->tail = start + size;
+    index_add(history, start);
+
+    history_unlock(history);
+    return 0;
+}
+
+void history_lock(struct history * history)
+{
+    pthread_mutex_lock(&history->lock);
+}
+
+void history_unlock(struct history * history)
+{
+    pthread_mutex_unlock(&history->lock);
+}
+
+uint64_t history_find(const struct history * history, uint64_t offset)
+{
+    uint64_t at = skip_pad(history, history->header->head);
+
+    // start from the last indexed record at or before offset that is kept
+    uint64_t low = history->index_first;
+    uint64_t high = history->index_last;
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (history->index[middle % history->index_size] <= offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low > history->index_first && history->index[(low - 1) % history->index_size] > at)
+    {
+        at = history->index[(low - 1) % history->index_size];
+    }
+
+    while (at < offset && at != history->header->tail)
+    {
+        at = next_record(history, at);
+    }
+    return at;
+}
+
+const char * history_record(const struct history * history, uint64_t offset, size_t * len, uint64_t * next)
+{
+    *len = length_at(history, offset);
+    *next = next_record(history, offset);
+    return history->data + offset % history->capacity + sizeof(uint32_t);
+}
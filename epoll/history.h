@@ -0,0 +1,71 @@
+#ifndef EPOLL_HISTORY_H
+#define EPOLL_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HISTORY_HEADER_SIZE     4096            // one page in front of the ring
+#define HISTORY_INDEX_EVERY     64              // records between two sparse index entries
+
+// what the file starts with, so a restart picks the ring up where it was
+struct history_header
+{
+    uint64_t magic;
+    uint64_t capacity;          // ring bytes behind the header
+    uint64_t head;              // offset of the oldest record still kept
+    uint64_t tail;              // offset the next record is written at
+};
+
+// message log in a memory-mapped ring file. offsets only ever grow, a
+// record lives at offset % capacity as a 32 bit length and the payload
+// padded to 4 bytes, and a record that would cross the end of the ring is
+// moved to the start behind a pad marker. appending evicts the oldest
+// records, so it is O(1) apart from the eviction walk, and never syncs:
+// a background thread msyncs the mapping every sync_interval seconds.
+// readers take the lock and point iovecs straight into the mapping.
+// every HISTORY_INDEX_EVERY-th record offset goes into a sparse index kept
+// in memory, so finding an offset walks at most that many records.
+struct history
+{
+    int fd;
+    struct history_header * header;
+    char * data;
+    uint64_t capacity;
+    uint64_t * index;           // ring of record offsets, ascending
+    uint64_t index_size;
+    uint64_t index_first;       // entries index_first up to index_last are kept
+    uint64_t index_last;
+    uint64_t records;           // appended since open, picks the indexed ones
+    pthread_mutex_t lock;
+    unsigned int sync_interval; // 0 leaves writeback to the kernel
+    pthread_t sync_thread;
+    int stop;
+};
+
+// capacity is rounded up to a multiple of 4. an existing file of the same
+// capacity is reused with its records, anything else starts empty. the
+// records are walked once and the ring is cut at the first one that does
+// not make sense, the header may have reached the disk without its data.
+int history_open(struct history * history, const char * path, uint64_t capacity, unsigned int sync_interval);
+void history_close(struct history * history);
+// returns -1 for a record larger than half the ring, it is not kept
+int history_append(struct history * history, const char * data, size_t len);
+
+// the rest runs under the lock
+void history_lock(struct history * history);
+void history_unlock(struct history * history);
+// offset of the first record at or after offset, clamped to what is kept
+uint64_t history_find(const struct history * history, uint64_t offset);
+// payload of the record at offset and the offset of the one after it
+const char * history_record(const struct history * history, uint64_t offset, size_t * len, uint64_t * next);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EPOLL_HISTORY_H
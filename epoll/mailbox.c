@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "mailbox.h"
+
+int mailbox_init(struct mailbox * mailbox)
+{
+    mailbox->stub.next = NULL;
+    mailbox->head = &mailbox->stub;
+    mailbox->tail = &mailbox->stub;
+    mailbox->pending = 0;
+    mailbox->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return mailbox->fd < 0 ? -1 : 0;
+}
+
+void mailbox_destroy(struct mailbox * mailbox)
+{
+    if (mailbox->fd >= 0)
+    {
+        close(mailbox->fd);
+        mailbox->fd = -1;
+    }
+}
+
+static void push(struct mailbox * mailbox, struct post * post)
+{
+    __atomic_store_n(&post->next, NULL, __ATOMIC_RELAXED);
+    struct post * prev = __atomic_exchange_n(&mailbox->tail, post, __ATOMIC_ACQ_REL);
+    // between the exchange and this store the chain is broken for the consumer
+    __atomic_store_n(&prev->next, post, __ATOMIC_RELEASE);
+}
+
+void mailbox_post(struct mailbox * mailbox, struct post * post)
+{
+    push(mailbox, post);
+
+    if (__atomic_exchange_n(&mailbox->pending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        uint64_t one = 1;
+        if (write(mailbox->fd, &one, sizeof(one)) != sizeof(one))
+        {
+            perror("mailbox doorbell\n");
+        }
+    }
+}
+
+// NULL when empty, or when a producer is between its exchange and its link.
+// that producer has not rung the doorbell yet and will, so nothing is lost.
+static struct post * pop(struct mailbox * mailbox)
+{
+    struct post * head = mailbox->head;
+    struct post * next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &mailbox->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        mailbox->head = next;
+        head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next)
+    {
+        mailbox->head = next;
+        return head;
+    }
+
+    if (head != __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    // head is the last post, put the stub behind it so it can be detached
+    push(mailbox, &mailbox->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        mailbox->head = next;
+        return head;
+    }
+
+    return NULL;
+}
+
+unsigned long mailbox_drain(struct mailbox * mailbox)
+{
+    unsigned long count = 0;
+    struct post * post;
+
+    // answer the doorbell before looking at the queue, a post that lands
+    // after this rings it again
+    __atomic_exchange_n(&mailbox->pending, 0, __ATOMIC_SEQ_CST);
+
+    while ((post = pop(mailbox)) != NULL)
+    {
+        post->fn(post);
+        ++count;
+    }
+
+    return count;
+}
@@ -0,0 +1,44 @@
+#ifndef EPOLL_MAILBOX_H
+#define EPOLL_MAILBOX_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// intrusive message, embed it in whatever the other thread hands over. fn
+// runs on the owning thread and may free the containing object.
+struct post
+{
+    struct post * next;
+    void (*fn)(struct post * post);
+};
+
+// multi-producer single-consumer queue (Vyukov's intrusive design) with an
+// eventfd doorbell. a post is one exchange on the tail and one store, the
+// doorbell is only rung by the first post after the consumer last drained,
+// so a burst of posts costs one eventfd write and one wakeup.
+struct mailbox
+{
+    struct post * head;         // consumer side
+    char pad[64 - sizeof(struct post *)];
+    struct post * tail;         // producers swap themselves in here
+    int pending;                // doorbell rung and not yet answered
+    struct post stub;
+    int fd;                     // eventfd the consumer polls
+};
+
+int mailbox_init(struct mailbox * mailbox);
+void mailbox_destroy(struct mailbox * mailbox);
+// any thread
+void mailbox_post(struct mailbox * mailbox, struct post * post);
+// owning thread, after the eventfd was read. runs every post queued so far
+// and returns how many.
+unsigned long mailbox_drain(struct mailbox * mailbox);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EPOLL_MAILBOX_H
@@ -1,8 +1,14 @@
+/*
+build:
+gcc -O2 -Wall -pthread -I.. poll.c histogram.c history.c ../ringlog.c -o poll
+*/
+
 #define __USE_GNU
 #define _GNU_SOURCE
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -13,103 +19,1622 @@
 #include <string.h>
 #include <pthread.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define PORT                5000
-#define BACKLOG               30
-#define BUFFERSIZE            (64 * 1024)
-#define MAXCLIENTS            10
+#include "histogram.h"
+#include "history.h"
+#include "ringlog.h"
+
+#define PORT                5000
+#define BACKLOG               SOMAXCONN
+#define BUFFERSIZE            (64 * 1024)
+#define MAXCLIENTS            100000        // default limit, -m changes it
+#define MAXEVENTS             64
+#define MAXIOV                64            // queued messages handed to one sendmsg
+#define MAXSHARDS             64
+#define RING_SIZE             1024          // messages in flight from one shard to another, power of two
+#define MAXTOPIC              256           // topic name bytes
+#define REPORT_INTERVAL       10            // seconds between queue reports of one event loop
+#define HISTORY_SIZE          (64 * 1024 * 1024)
+
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+// one received chunk, shared read-only by every client it is queued on and
+// freed when the last of them has sent it. shards drop their references
+// concurrently, so the count is atomic.
+struct message
+{
+    size_t refs;
+    size_t len;
+    size_t topic_offset;        // where in data the topic name is, for the shards that deliver it
+    size_t topic_len;           // 0 for a plain broadcast to everyone
+    char data[];
+};
+
+// intrusive chained hash table, lookups walk the bucket and compare themselves
+struct hash_node
+{
+    struct hash_node * next;
+    uint64_t hash;
+};
+
+struct hash_table
+{
+    struct hash_node ** buckets;
+    size_t mask;
+    size_t count;
+};
+
+// growable ring of message pointers
+struct queue
+{
+    struct message ** items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+struct client
+{
+    int socket_fd;
+    struct sockaddr_in addr;
+    size_t index;               // position in ctx.live
+    struct client * next;       // ctx.closed link
+    struct queue queue;         // messages not yet fully sent
+    size_t queue_offset;        // bytes of the head message already sent
+    int want_write;             // waiting for writability with a non-empty queue
+    size_t queue_bytes;         // bytes of the queued messages, the partly sent head counted whole
+    unsigned long dropped;      // messages this client lost to its queue limits
+    unsigned long dropped_bytes;
+    uint64_t replay_pos;        // history record being replayed, sent before anything queued
+    uint64_t replay_end;        // history tail when the replay was asked for
+    size_t replay_skip;         // bytes of the record at replay_pos already sent
+    int replay_pending;         // REPLAY asked for mid-message, starts at the next boundary
+    uint64_t replay_from;       // offset the pending replay starts from
+    char * in;                  // rooms mode: partial command line
+    size_t in_len;
+    struct subscription ** subs;        // topics joined, dense
+    size_t sub_count;
+    size_t sub_capacity;
+};
+
+// a room and the clients in it. delivery walks only subs.
+struct topic
+{
+    struct hash_node node;      // ctx.topics, keyed by name
+    struct subscription ** subs;
+    size_t count;
+    size_t capacity;
+    int idle;                   // on ctx.idle_topics waiting to be freed
+    struct topic * idle_next;
+    size_t len;
+    char name[];
+};
+
+// one client in one topic, sitting in both dense arrays so leaving is two
+// swap removals once the (client, topic) lookup found it
+struct subscription
+{
+    struct hash_node node;      // ctx.subscriptions, keyed by client and topic
+    struct client * client;
+    struct topic * topic;
+    size_t client_index;        // position in client->subs
+    size_t topic_index;         // position in topic->subs
+};
+
+// single-producer single-consumer ring, one for every ordered pair of shards
+struct ring
+{
+    size_t head;                // consumer side
+    char pad[64 - sizeof(size_t)];
+    size_t tail;                // producer side
+    char pad2[64 - sizeof(size_t)];
+    struct message * items[RING_SIZE];
+};
+
+// one event loop thread owning a partition of the clients. messages read on
+// one shard reach the others through the rings, and an eventfd doorbell that
+// is only rung by the first push after the shard last drained.
+struct shard
+{
+    pthread_t thread;
+    unsigned int id;
+    int doorbell;
+    int pending;                // doorbell rung and not yet answered
+    unsigned long deliveries;   // messages queued to a client, summed by the stats loop
+    int failed;                 // could not start or its loop gave up, the stats loop exits on it
+    struct queue backlog[MAXSHARDS];    // pushes that found the peer's ring full, in order
+    char pad[64];
+};
+
+// clients are found by fd through a table that grows to the highest fd seen,
+// and walked through a dense array of the live ones. removal moves the last
+// live client into the hole, so add, find and remove are all O(1).
+struct context
+{
+    struct client ** by_fd;     // fd -> client, NULL for fds that are not clients
+    size_t fd_capacity;
+    struct client ** live;
+    size_t count;
+    size_t capacity;
+    size_t max_clients;
+    struct client * closed;     // closed while events may still point at them, freed after the batch
+    int epoll_fd;               // -1 in poll mode
+    struct shard * shard;       // NULL unless sharded
+    struct hash_table topics;
+    struct hash_table subscriptions;
+    struct topic * idle_topics; // emptied topics, freed after the batch like closed clients
+    struct histogram * depths;  // queue depth in messages, sampled on every enqueue
+    unsigned long dropped;      // since the last report
+    unsigned long disconnected;
+    time_t next_report;
+};
+
+// what a client's queue does when the next message would exceed a limit
+enum queue_policy
+{
+    DROP_OLDEST,                // lose queued messages not yet on the wire
+    DROP_NEWEST,                // lose the message that does not fit
+    DISCONNECT,                 // close the slow consumer
+};
+
+// every shard thread runs the same loop on its own context
+__thread struct context ctx;
+
+size_t max_clients = MAXCLIENTS;
+unsigned int shard_count;
+int rooms;                      // line commands and topics instead of broadcasting raw bytes
+size_t queue_max_bytes;         // 0 is unlimited
+size_t queue_max_messages;
+enum queue_policy queue_policy;
+struct history history;         // shared by all shards
+const char * history_path;      // NULL keeps no history
+uint64_t history_size = HISTORY_SIZE;
+unsigned int history_sync = 1;
+int replay_on_join;             // raw mode: new clients first get the whole history
+struct shard * shards;
+struct ring * rings;            // rings[from * shard_count + to]
+
+//int setnonblocking(int sfd)
+//{
+//    int flags, s;
+//    flags = fcntl(sfd, F_GETFL, 0);
+//    if (flags == -1) { perror("fcntl"); return -1; }
+//    flags |= O_NONBLOCK;
+//    s = fcntl(sfd, F_SETFL, flags);
+//    if (s == -1) { perror("fcntl"); return -1; }
+//    return 0;
+//}
+
+static int grow(struct client *** array, size_t * capacity, size_t needed)
+{
+    size_t new_capacity = *capacity ? *capacity : 1024;
+    while (new_capacity < needed)
+    {
+        new_capacity <<= 1;
+    }
+
+    struct client ** items = realloc(*array, new_capacity * sizeof(*items));
+    if (items == NULL)
+    {
+        return -1;
+    }
+
+    memset(items + *capacity, 0, (new_capacity - *capacity) * sizeof(*items));
+    *array = items;
+    *capacity = new_capacity;
+    return 0;
+}
+
+struct client * client_add(int fd, const struct sockaddr_in * addr)
+{
+    if (ctx.count >= max_clients)
+    {
+        return NULL;
+    }
+
+    if (((size_t) fd >= ctx.fd_capacity && grow(&ctx.by_fd, &ctx.fd_capacity, (size_t) fd + 1) < 0) ||
+        (ctx.count == ctx.capacity && grow(&ctx.live, &ctx.capacity, ctx.count + 1) < 0))
+    {
+        return NULL;
+    }
+
+    struct client * client = malloc(sizeof(*client));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+
+    client->socket_fd = fd;
+    client->addr = *addr;
+    client->index = ctx.count;
+    client->next = NULL;
+    memset(&client->queue, 0, sizeof(client->queue));
+    client->queue_offset = 0;
+    client->queue_bytes = 0;
+    client->dropped = 0;
+    client->dropped_bytes = 0;
+    client->replay_pos = 0;
+    client->replay_end = 0;
+    client->replay_skip = 0;
+    client->replay_pending = 0;
+    client->replay_from = 0;
+    client->in = NULL;
+    client->in_len = 0;
+    client->subs = NULL;
+    client->sub_count = 0;
+    client->sub_capacity = 0;
+    client->want_write = 0;
+    ctx.live[ctx.count++] = client;
+    ctx.by_fd[fd] = client;
+    return client;
+}
+
+struct client * client_find(int fd)
+{
+    return (size_t) fd < ctx.fd_capacity ? ctx.by_fd[fd] : NULL;
+}
+
+// unlink the client from both tables. the memory stays valid until
+// release_closed so events already fetched for it can still be looked at.
+void client_remove(struct client * client)
+{
+    struct client * last = ctx.live[--ctx.count];
+    ctx.live[client->index] = last;
+    last->index = client->index;
+
+    ctx.by_fd[client->socket_fd] = NULL;
+    client->socket_fd = -1;
+    client->next = ctx.closed;
+    ctx.closed = client;
+}
+
+void topic_sweep(struct topic * topic);
+struct topic * topic_find(const char * name, size_t len);
+struct subscription * subscription_find(const struct client * client, const struct topic * topic);
+
+void release_closed(void)
+{
+    while (ctx.idle_topics)
+    {
+        struct topic * next = ctx.idle_topics->idle_next;
+        topic_sweep(ctx.idle_topics);
+        ctx.idle_topics = next;
+    }
+
+    while (ctx.closed)
+    {
+        struct client * next = ctx.closed->next;
+        free(ctx.closed->queue.items);
+        free(ctx.closed->in);
+        free(ctx.closed->subs);
+        free(ctx.closed);
+        ctx.closed = next;
+    }
+}
+
+struct message * message_alloc(size_t len)
+{
+    struct message * message = malloc(sizeof(*message) + len);
+    if (message)
+    {
+        message->refs = 1;
+        message->len = len;
+        message->topic_offset = 0;
+        message->topic_len = 0;
+    }
+
+    return message;
+}
+
+struct message * message_new(const char * data, size_t len)
+{
+    struct message * message = message_alloc(len);
+    if (message)
+    {
+        memcpy(message->data, data, len);
+    }
+
+    return message;
+}
+
+void message_get(struct message * message, size_t refs)
+{
+    __atomic_add_fetch(&message->refs, refs, __ATOMIC_RELAXED);
+}
+
+void message_put(struct message * message)
+{
+    if (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(message);
+    }
+}
+
+int queue_push(struct queue * queue, struct message * message)
+{
+    if (queue->count == queue->capacity)
+    {
+        size_t capacity = queue->capacity ? queue->capacity << 1 : 16;
+        struct message ** items = malloc(capacity * sizeof(*items));
+        if (items == NULL)
+        {
+            return -1;
+        }
+
+        for (size_t i = 0; i < queue->count; ++i)
+        {
+            items[i] = queue->items[(queue->head + i) % queue->capacity];
+        }
+        free(queue->items);
+        queue->items = items;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = message;
+    ++queue->count;
+    return 0;
+}
+
+struct message * queue_at(const struct queue * queue, size_t i)
+{
+    return queue->items[(queue->head + i) % queue->capacity];
+}
+
+struct message * queue_pop(struct queue * queue)
+{
+    struct message * message = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    return message;
+}
+
+// take out the item at i by moving the ones before it up a slot, meant for
+// i close to the head
+struct message * queue_remove(struct queue * queue, size_t i)
+{
+    struct message * message = queue_at(queue, i);
+    for (; i > 0; --i)
+    {
+        queue->items[(queue->head + i) % queue->capacity] = queue_at(queue, i - 1);
+    }
+    queue_pop(queue);
+    return message;
+}
+
+// the caller has taken the reference the queue now holds
+int client_enqueue(struct client * client, struct message * message)
+{
+    if (queue_push(&client->queue, message) < 0)
+    {
+        return -1;
+    }
+
+    client->queue_bytes += message->len;
+    histogram_record(ctx.depths, client->queue.count);
+    return 0;
+}
+
+void client_dequeue(struct client * client)
+{
+    struct message * message = queue_pop(&client->queue);
+    client->queue_bytes -= message->len;
+    client->queue_offset = 0;
+    message_put(message);
+}
+
+static int over_limit(const struct client * client, size_t len)
+{
+    return (queue_max_messages && client->queue.count + 1 > queue_max_messages) ||
+           (queue_max_bytes && client->queue_bytes + len > queue_max_bytes);
+}
+
+static void count_drop(struct client * client, size_t len)
+{
+    ++client->dropped;
+    client->dropped_bytes += len;
+    ++ctx.dropped;
+}
+
+// apply the queue limits before a message is queued. returns 1 when it may be
+// queued, 0 when it was dropped and -1 when the client has to be closed.
+// the partly sent head is never dropped, the stream would lose its framing.
+int client_admit(struct client * client, const struct message * message)
+{
+    while (over_limit(client, message->len))
+    {
+        switch (queue_policy)
+        {
+            case DROP_NEWEST:
+                count_drop(client, message->len);
+                return 0;
+            case DISCONNECT:
+                ++ctx.disconnected;
+                return -1;
+            case DROP_OLDEST:
+            {
+                size_t oldest = client->queue_offset ? 1 : 0;
+                if (client->queue.count <= oldest)
+                {
+                    return 1;   // nothing left to give up but the head on the wire
+                }
+
+                struct message * dropped = queue_remove(&client->queue, oldest);
+                client->queue_bytes -= dropped->len;
+                count_drop(client, dropped->len);
+                message_put(dropped);
+                break;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// ask for writability while output is queued. in poll mode the pollfd
+// rebuild picks want_write up by itself.
+void client_want_write(struct client * client, int want)
+{
+    if (client->want_write == want)
+    {
+        return;
+    }
+
+    client->want_write = want;
+    if (ctx.epoll_fd >= 0)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0);
+        event.data.ptr = client;
+        epoll_ctl(ctx.epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &event);
+    }
+}
+
+// start replaying the history from the first record at or after offset up
+// to what is in it now. anything already queued for the client follows the
+// replay, even if the replay covers it too. a message or record that is half
+// sent is finished first, client_flush starts the replay after it.
+void client_replay(struct client * client, uint64_t offset)
+{
+    if (client->queue_offset || client->replay_skip)
+    {
+        client->replay_pending = 1;
+        client->replay_from = offset;
+        return;
+    }
+
+    client->replay_pending = 0;
+    history_lock(&history);
+    client->replay_pos = history_find(&history, offset);
+    client->replay_end = history.header->tail;
+    client->replay_skip = 0;
+    history_unlock(&history);
+}
+
+// rooms mode keeps one history for every topic, a replay only carries the
+// MSG lines of topics the client is in. called with the history locked.
+static int replay_wanted(const struct client * client, const char * data, size_t len)
+{
+    if (!rooms)
+    {
+        return 1;
+    }
+
+    if (len < 4 || memcmp(data, "MSG ", 4) != 0)
+    {
+        return 0;
+    }
+
+    const char * end = memchr(data + 4, ' ', len - 4);
+    if (end == NULL)
+    {
+        return 0;
+    }
+
+    struct topic * topic = topic_find(data + 4, end - data - 4);
+    return topic && subscription_find(client, topic);
+}
+
+// send history records straight out of the mapping, writev style. the
+// ranges are picked under the history lock and sent without it, so head is
+// checked again after each send: a record evicted meanwhile may have been
+// overwritten while the kernel copied it. records evicted before their turn
+// are counted as dropped, unless one was half sent: the stream cannot go on
+// from there. returns 1 when the replay is done, 0 when the socket is full
+// and -1 when the client has to be closed.
+int flush_replay(struct client * client)
+{
+    while (client->replay_pos < client->replay_end)
+    {
+        struct iovec iov[MAXIOV];
+        uint64_t next[MAXIOV];
+        size_t count = 0;
+
+        history_lock(&history);
+        if (client->replay_pos < history.header->head)
+        {
+            if (client->replay_skip)
+            {
+                history_unlock(&history);
+                fprintf(stderr, "replay on %d overtaken by the history ring\n", client->socket_fd);
+                return -1;
+            }
+
+            uint64_t head = history_find(&history, 0);
+            ++client->dropped;
+            client->dropped_bytes += head - client->replay_pos;
+            client->replay_pos = head;
+        }
+
+        // records of other topics are passed over, a bounded number per lock
+        uint64_t at = client->replay_pos;
+        for (size_t seen = 0; count < MAXIOV && seen < MAXIOV * 16 && at < client->replay_end; ++seen)
+        {
+            size_t len;
+            uint64_t record = at;
+            const char * data = history_record(&history, at, &len, &at);
+            if (!(record == client->replay_pos && client->replay_skip) && !replay_wanted(client, data, len))
+            {
+                if (count == 0)
+                {
+                    client->replay_pos = at;
+                }
+                else
+                {
+                    next[count - 1] = at;
+                }
+                continue;
+            }
+
+            size_t skip = count == 0 ? client->replay_skip : 0;
+            iov[count].iov_base = (char *) data + skip;
+            iov[count].iov_len = len - skip;
+            next[count] = at;
+            ++count;
+        }
+        history_unlock(&history);
+
+        if (count == 0)
+        {
+            continue;
+        }
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(client->socket_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        history_lock(&history);
+        uint64_t head = history.header->head;
+        history_unlock(&history);
+        if (sent > 0 && head > client->replay_pos)
+        {
+            fprintf(stderr, "replay on %d overtaken by the history ring\n", client->socket_fd);
+            return -1;
+        }
+
+        for (size_t i = 0; i < count && sent > 0; ++i)
+        {
+            if ((size_t) sent < iov[i].iov_len)
+            {
+                client->replay_skip += sent;
+                break;
+            }
+            sent -= iov[i].iov_len;
+            client->replay_pos = next[i];
+            client->replay_skip = 0;
+        }
+    }
+
+    return 1;
+}
+
+// send as much of the queue as the socket takes, writev style: one sendmsg
+// covers up to MAXIOV messages. a pending replay goes in at the first message
+// boundary. returns -1 when the client has to be closed.
+int client_flush(struct client * client)
+{
+    while (1)
+    {
+        if (client->replay_pos < client->replay_end)
+        {
+            int done = flush_replay(client);
+            if (done <= 0)
+            {
+                if (done == 0)
+                {
+                    client_want_write(client, 1);
+                }
+                return done;
+            }
+        }
+
+        if (client->replay_pending && client->queue_offset == 0)
+        {
+            client_replay(client, client->replay_from);
+            continue;
+        }
+
+        if (client->queue.count == 0)
+        {
+            break;
+        }
+
+        // only the half sent head goes out before a pending replay
+        struct iovec iov[MAXIOV];
+        size_t count = client->queue.count < MAXIOV ? client->queue.count : MAXIOV;
+        if (client->replay_pending)
+        {
+            count = 1;
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            struct message * message = queue_at(&client->queue, i);
+            size_t skip = i == 0 ? client->queue_offset : 0;
+            iov[i].iov_base = message->data + skip;
+            iov[i].iov_len = message->len - skip;
+        }
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(client->socket_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                client_want_write(client, 1);
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        while (sent > 0)
+        {
+            struct message * message = queue_at(&client->queue, 0);
+            size_t left = message->len - client->queue_offset;
+            if ((size_t) sent < left)
+            {
+                client->queue_offset += sent;
+                break;
+            }
+            sent -= left;
+            client_dequeue(client);
+        }
+    }
+
+    client_want_write(client, 0);
+    return 0;
+}
+
+void * thread_accept_func(void * args)
+{
+    int socket = *(int *) args;
+    struct sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    while (1)
+    {
+        int client_fd = accept4(socket, &addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd > 0)
+        {
+            if (client_add(client_fd, &addr) == NULL)
+            {
+                fprintf(stderr, "cannot accept new client %d.\n", client_fd);
+                shutdown(client_fd, SHUT_RDWR);
+                close(client_fd);
+            }
+            else
+            {
+                uint32_t ip = ntohl(addr.sin_addr.s_addr);
+                rlog(RL_INFO, "Accept from (%lu) %lu.%lu.%lu.%lu:%lu\n", client_fd, ip >> 24, (ip >> 16) & 0xff,
+                     (ip >> 8) & 0xff, ip & 0xff, ntohs(addr.sin_port));
+            }
+        }
+        else
+        {
+            rlog(RL_DEBUG, "accept4: %ld\n", client_fd);
+        }
+    }
+
+    return NULL;
+}
+
+uint64_t hash_bytes(const char * data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t hash_pair(const void * a, const void * b)
+{
+    uint64_t hash = ((uintptr_t) a * 0x9e3779b97f4a7c15ull) ^ (uintptr_t) b;
+    return hash ^ (hash >> 29);
+}
+
+struct hash_node * hash_first(const struct hash_table * table, uint64_t hash)
+{
+    return table->buckets ? table->buckets[hash & table->mask] : NULL;
+}
+
+int hash_insert(struct hash_table * table, struct hash_node * node)
+{
+    if (table->count >= table->mask)
+    {
+        size_t size = table->buckets ? (table->mask + 1) << 1 : 64;
+        struct hash_node ** buckets = calloc(size, sizeof(*buckets));
+        if (buckets == NULL)
+        {
+            return -1;
+        }
+
+        for (size_t i = 0; table->buckets && i <= table->mask; ++i)
+        {
+            while (table->buckets[i])
+            {
+                struct hash_node * moved = table->buckets[i];
+                table->buckets[i] = moved->next;
+                moved->next = buckets[moved->hash & (size - 1)];
+                buckets[moved->hash & (size - 1)] = moved;
+            }
+        }
+        free(table->buckets);
+        table->buckets = buckets;
+        table->mask = size - 1;
+    }
+
+    struct hash_node ** bucket = &table->buckets[node->hash & table->mask];
+    node->next = *bucket;
+    *bucket = node;
+    ++table->count;
+    return 0;
+}
+
+void hash_remove(struct hash_table * table, struct hash_node * node)
+{
+    struct hash_node ** link = &table->buckets[node->hash & table->mask];
+    while (*link != node)
+    {
+        link = &(*link)->next;
+    }
+    *link = node->next;
+    --table->count;
+}
+
+struct topic * topic_find(const char * name, size_t len)
+{
+    uint64_t hash = hash_bytes(name, len);
+    for (struct hash_node * node = hash_first(&ctx.topics, hash); node; node = node->next)
+    {
+        struct topic * topic = container_of(node, struct topic, node);
+        if (node->hash == hash && topic->len == len && memcmp(topic->name, name, len) == 0)
+        {
+            return topic;
+        }
+    }
+    return NULL;
+}
+
+void topic_sweep(struct topic * topic)
+{
+    if (topic->count == 0)
+    {
+        hash_remove(&ctx.topics, &topic->node);
+        free(topic->subs);
+        free(topic);
+    }
+    else
+    {
+        topic->idle = 0;        // joined again before the sweep
+    }
+}
+
+struct subscription * subscription_find(const struct client * client, const struct topic * topic)
+{
+    uint64_t hash = hash_pair(client, topic);
+    for (struct hash_node * node = hash_first(&ctx.subscriptions, hash); node; node = node->next)
+    {
+        struct subscription * sub = container_of(node, struct subscription, node);
+        if (sub->client == client && sub->topic == topic)
+        {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+static int grow_subs(struct subscription *** array, size_t * capacity, size_t count)
+{
+    if (count < *capacity)
+    {
+        return 0;
+    }
+
+    size_t new_capacity = *capacity ? *capacity << 1 : 4;
+    struct subscription ** subs = realloc(*array, new_capacity * sizeof(*subs));
+    if (subs == NULL)
+    {
+        return -1;
+    }
+
+    *array = subs;
+    *capacity = new_capacity;
+    return 0;
+}
+
+int subscribe(struct client * client, const char * name, size_t len)
+{
+    struct topic * topic = topic_find(name, len);
+    if (topic == NULL)
+    {
+        topic = calloc(1, sizeof(*topic) + len);
+        if (topic == NULL)
+        {
+            return -1;
+        }
+
+        topic->node.hash = hash_bytes(name, len);
+        topic->len = len;
+        memcpy(topic->name, name, len);
+        if (hash_insert(&ctx.topics, &topic->node) < 0)
+        {
+            free(topic);
+            return -1;
+        }
+    }
+    else if (subscription_find(client, topic))
+    {
+        return 0;
+    }
+
+    struct subscription * sub = malloc(sizeof(*sub));
+    if (sub == NULL ||
+        grow_subs(&topic->subs, &topic->capacity, topic->count) < 0 ||
+        grow_subs(&client->subs, &client->sub_capacity, client->sub_count) < 0)
+    {
+        free(sub);
+        return -1;
+    }
+
+    sub->node.hash = hash_pair(client, topic);
+    sub->client = client;
+    sub->topic = topic;
+    if (hash_insert(&ctx.subscriptions, &sub->node) < 0)
+    {
+        free(sub);
+        return -1;
+    }
+
+    sub->topic_index = topic->count;
+    topic->subs[topic->count++] = sub;
+    sub->client_index = client->sub_count;
+    client->subs[client->sub_count++] = sub;
+    return 0;
+}
+
+void subscription_remove(struct subscription * sub)
+{
+    struct topic * topic = sub->topic;
+    struct client * client = sub->client;
+
+    struct subscription * last = topic->subs[--topic->count];
+    topic->subs[sub->topic_index] = last;
+    last->topic_index = sub->topic_index;
+
+    last = client->subs[--client->sub_count];
+    client->subs[sub->client_index] = last;
+    last->client_index = sub->client_index;
+
+    hash_remove(&ctx.subscriptions, &sub->node);
+    free(sub);
+
+    // a delivery may still be walking the topic, free it after the batch
+    if (topic->count == 0 && !topic->idle)
+    {
+        topic->idle = 1;
+        topic->idle_next = ctx.idle_topics;
+        ctx.idle_topics = topic;
+    }
+}
+
+void unsubscribe(struct client * client, const char * name, size_t len)
+{
+    struct topic * topic = topic_find(name, len);
+    struct subscription * sub = topic ? subscription_find(client, topic) : NULL;
+    if (sub)
+    {
+        subscription_remove(sub);
+    }
+}
+
+void close_client(struct client * client)
+{
+    int fd = client->socket_fd;
+    rlog(RL_DEBUG, "close event on %lu\n", fd);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+
+    while (client->queue.count)
+    {
+        client_dequeue(client);
+    }
+
+    while (client->sub_count)
+    {
+        subscription_remove(client->subs[client->sub_count - 1]);
+    }
+
+    uint32_t ip = ntohl(client->addr.sin_addr.s_addr);
+    rlog(RL_INFO, "Disconnect from (%lu) %lu.%lu.%lu.%lu:%lu, dropped %lu messages %lu bytes\n", fd, ip >> 24,
+         (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, ntohs(client->addr.sin_port), client->dropped,
+         client->dropped_bytes);
+    client_remove(client);
+}
+
+// accept everything pending on the listener. in epoll mode the client is
+// registered once here and stays in the interest set until it is closed.
+void accept_clients(int server_socket)
+{
+    struct sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    while (1)
+    {
+        int client_fd = accept4(server_socket, &addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd > 0)
+        {
+            struct client * client = client_add(client_fd, &addr);
+            if (client == NULL)
+            {
+                fprintf(stderr, "cannot accept new client.\n");
+                shutdown(client_fd, SHUT_RDWR);
+                close(client_fd);
+                continue;
+            }
+
+            if (ctx.epoll_fd >= 0)
+            {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLRDHUP;
+                event.data.ptr = client;
+                if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0)
+                {
+                    fprintf(stderr, "failed to add client %d: %d %s\n", client_fd, errno, strerror(errno));
+                    client_remove(client);
+                    close(client_fd);
+                    continue;
+                }
+            }
+
+            uint32_t ip = ntohl(addr.sin_addr.s_addr);
+            rlog(RL_INFO, "Accept from (%lu) %lu.%lu.%lu.%lu:%lu\n", client_fd, ip >> 24, (ip >> 16) & 0xff,
+                 (ip >> 8) & 0xff, ip & 0xff, ntohs(addr.sin_port));
+
+            if (history_path && replay_on_join)
+            {
+                client_replay(client, 0);
+                if (client_flush(client) < 0)
+                {
+                    close_client(client);
+                }
+            }
+        }
+        else
+        {
+            rlog(RL_DEBUG, "accept4: %ld\n", client_fd);
+            break;
+        }
+    }
+}
+
+static struct client * recipient(const struct topic * topic, size_t j)
+{
+    return topic ? topic->subs[j]->client : ctx.live[j];
+}
+
+// every local client but the sender, or every subscriber of the topic, queues
+// a reference to the message, so a slow reader holds pointers, not copies, and
+// never holds up the rest. the references are taken in one atomic add before
+// any queue is flushed, and an idle queue is flushed right away.
+void fan_out(const struct client * from, struct message * message, const struct topic * topic)
+{
+    size_t queued = 0;
+
+    // backwards, so closing a client only moves one already visited into its slot
+    for (size_t j = topic ? topic->count : ctx.count; j-- > 0;)
+    {
+        struct client * client = recipient(topic, j);
+        if (client == from)
+        {
+            continue;
+        }
+
+        int admit = client_admit(client, message);
+        if (admit == 0)
+        {
+            continue;
+        }
+        if (admit < 0 || client_enqueue(client, message) < 0)
+        {
+            close_client(client);
+            continue;
+        }
+        ++queued;
+    }
+
+    if (queued == 0)
+    {
+        return;
+    }
+
+    message_get(message, queued);
+    if (ctx.shard)
+    {
+        __atomic_add_fetch(&ctx.shard->deliveries, queued, __ATOMIC_RELAXED);
+    }
+
+    for (size_t j = topic ? topic->count : ctx.count; j-- > 0;)
+    {
+        struct client * client = recipient(topic, j);
+        if (client != from && client->queue.count == 1 && client_flush(client) < 0)
+        {
+            close_client(client);
+        }
+    }
+}
+
+int ring_push(struct ring * ring, struct message * message)
+{
+    size_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+    {
+        return -1;
+    }
+
+    ring->items[tail & (RING_SIZE - 1)] = message;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+struct message * ring_pop(struct ring * ring)
+{
+    size_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    struct message * message = ring->items[head & (RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return message;
+}
+
+void ring_doorbell(struct shard * shard)
+{
+    if (__atomic_exchange_n(&shard->pending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        uint64_t one = 1;
+        if (write(shard->doorbell, &one, sizeof(one)) != sizeof(one))
+        {
+            perror("shard doorbell\n");
+        }
+    }
+}
+
+// move what the peer's ring has room for out of the backlog, oldest first.
+// returns 1 when anything was pushed.
+int flush_backlog(unsigned int to)
+{
+    struct queue * backlog = &ctx.shard->backlog[to];
+    struct ring * ring = &rings[ctx.shard->id * shard_count + to];
+    int pushed = 0;
+
+    while (backlog->count && ring_push(ring, queue_at(backlog, 0)) == 0)
+    {
+        queue_pop(backlog);
+        pushed = 1;
+    }
+
+    return pushed;
+}
+
+// hand the message to every other shard, each push carries a reference
+void publish(struct message * message)
+{
+    message_get(message, shard_count - 1);
+
+    for (unsigned int to = 0; to < shard_count; ++to)
+    {
+        if (to == ctx.shard->id)
+        {
+            continue;
+        }
+
+        struct queue * backlog = &ctx.shard->backlog[to];
+        if ((backlog->count || ring_push(&rings[ctx.shard->id * shard_count + to], message) < 0) &&
+            queue_push(backlog, message) < 0)
+        {
+            fprintf(stderr, "shard %u dropped a message for shard %u\n", ctx.shard->id, to);
+            message_put(message);
+            continue;
+        }
+        ring_doorbell(&shards[to]);
+    }
+}
+
+// after the doorbell: deliver everything the other shards pushed so far
+void drain_rings(void)
+{
+    uint64_t value;
+    if (read(ctx.shard->doorbell, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        perror("shard doorbell\n");
+    }
+
+    // answer the doorbell before looking at the rings, a push that lands
+    // after this rings it again
+    __atomic_exchange_n(&ctx.shard->pending, 0, __ATOMIC_SEQ_CST);
+
+    for (unsigned int from = 0; from < shard_count; ++from)
+    {
+        struct ring * ring = &rings[from * shard_count + ctx.shard->id];
+        struct message * message;
+        while ((message = ring_pop(ring)) != NULL)
+        {
+            if (message->topic_len == 0)
+            {
+                fan_out(NULL, message, NULL);
+            }
+            else
+            {
+                struct topic * topic = topic_find(message->data + message->topic_offset, message->topic_len);
+                if (topic)
+                {
+                    fan_out(NULL, message, topic);
+                }
+            }
+            message_put(message);
+        }
+    }
+}
+
+void broadcast(const struct client * from, const char * buffer, size_t len)
+{
+    struct message * message = message_new(buffer, len);
+    if (message == NULL)
+    {
+        fprintf(stderr, "failed to allocate a message of %zu bytes\n", len);
+        return;
+    }
+
+    if (history_path)
+    {
+        history_append(&history, buffer, len);
+    }
+
+    // the reference from message_new is held until the fan-out is done
+    fan_out(from, message, NULL);
+    if (ctx.shard)
+    {
+        publish(message);
+    }
+    message_put(message);
+}
+
+// serialized once as "MSG <topic> <payload>\n", the same bytes go to every
+// subscriber on every shard
+void publish_topic(const struct client * from, const char * name, size_t len, const char * payload, size_t payload_len)
+{
+    struct message * message = message_alloc(4 + len + 1 + payload_len + 1);
+    if (message == NULL)
+    {
+        fprintf(stderr, "failed to allocate a message of %zu bytes\n", payload_len);
+        return;
+    }
+
+    char * out = message->data;
+    memcpy(out, "MSG ", 4);
+    memcpy(out + 4, name, len);
+    out[4 + len] = ' ';
+    memcpy(out + 4 + len + 1, payload, payload_len);
+    out[message->len - 1] = '\n';
+    message->topic_offset = 4;
+    message->topic_len = len;
+
+    if (history_path)
+    {
+        history_append(&history, message->data, message->len);
+    }
+
+    struct topic * topic = topic_find(name, len);
+    if (topic)
+    {
+        fan_out(from, message, topic);
+    }
+    if (ctx.shard)
+    {
+        publish(message);
+    }
+    message_put(message);
+}
+
+// a line for this client alone, queued behind what it already has
+void reply(struct client * client, const char * text, size_t len)
+{
+    struct message * message = message_new(text, len);
+    if (message == NULL)
+    {
+        return;
+    }
+
+    if (client_enqueue(client, message) < 0)
+    {
+        message_put(message);
+        return;
+    }
+
+    if (client->queue.count == 1 && client_flush(client) < 0)
+    {
+        close_client(client);
+    }
+}
+
+// with a history: HISTORY answers "HISTORY <oldest offset> <next offset>" and
+// REPLAY <offset> sends every kept message from that offset on
+void history_command(struct client * client, const char * line, size_t len)
+{
+    if (len == 7 && memcmp(line, "HISTORY", 7) == 0)
+    {
+        history_lock(&history);
+        uint64_t head = history_find(&history, 0);
+        uint64_t tail = history.header->tail;
+        history_unlock(&history);
+
+        char text[64];
+        reply(client, text, snprintf(text, sizeof(text), "HISTORY %lu %lu\n", head, tail));
+    }
+    else if (len > 7 && memcmp(line, "REPLAY ", 7) == 0)
+    {
+        char number[24];
+        size_t digits = len - 7 < sizeof(number) - 1 ? len - 7 : sizeof(number) - 1;
+        memcpy(number, line + 7, digits);
+        number[digits] = '\0';
+
+        client_replay(client, strtoull(number, NULL, 10));
+        if (client_flush(client) < 0)
+        {
+            close_client(client);
+        }
+    }
+}
+
+// SUB <topic>, UNSUB <topic> or PUB <topic> <payload>, one per line, and
+// the history commands. anything else is ignored.
+void handle_command(struct client * client, char * line, size_t len)
+{
+    if (len && line[len - 1] == '\r')
+    {
+        --len;
+    }
+
+    if (history_path && (len >= 7 && (memcmp(line, "HISTORY", 7) == 0 || memcmp(line, "REPLAY ", 7) == 0)))
+    {
+        history_command(client, line, len);
+        return;
+    }
+
+    char * space = memchr(line, ' ', len);
+    if (space == NULL)
+    {
+        return;
+    }
+
+    size_t verb_len = space - line;
+    char * name = space + 1;
+    size_t rest = len - verb_len - 1;
+    char * payload = memchr(name, ' ', rest);
+    size_t name_len = payload ? (size_t) (payload - name) : rest;
+    if (name_len == 0 || name_len > MAXTOPIC)
+    {
+        return;
+    }
+
+    if (verb_len == 3 && memcmp(line, "SUB", 3) == 0)
+    {
+        if (subscribe(client, name, name_len) < 0)
+        {
+            fprintf(stderr, "failed to subscribe %d to %.*s\n", client->socket_fd, (int) name_len, name);
+        }
+    }
+    else if (verb_len == 5 && memcmp(line, "UNSUB", 5) == 0)
+    {
+        unsubscribe(client, name, name_len);
+    }
+    else if (verb_len == 3 && memcmp(line, "PUB", 3) == 0 && payload)
+    {
+        publish_topic(client, name, name_len, payload + 1, rest - name_len - 1);
+    }
+}
+
+// rooms mode: collect lines in the client's input buffer. a line that does
+// not fit the buffer closes the client.
+int read_commands(struct client * client)
+{
+    if (client->in == NULL && (client->in = malloc(BUFFERSIZE)) == NULL)
+    {
+        close_client(client);
+        return 0;
+    }
+
+    if (client->in_len == BUFFERSIZE)
+    {
+        fprintf(stderr, "command line too long on %d\n", client->socket_fd);
+        close_client(client);
+        return 0;
+    }
+
+    ssize_t read_size = recv(client->socket_fd, client->in + client->in_len, BUFFERSIZE - client->in_len, 0);
+    if (read_size == 0)
+    {
+        close_client(client);
+        return 0;
+    }
+    if (read_size < 0)
+    {
+        return 1;
+    }
+
+    size_t start = 0;
+    size_t end = client->in_len + read_size;
+    char * newline;
+    while ((newline = memchr(client->in + start, '\n', end - start)) != NULL)
+    {
+        handle_command(client, client->in + start, newline - (client->in + start));
+        if (client->socket_fd < 0)
+        {
+            return 0;           // closed by a failed reply or replay
+        }
+        start = newline - client->in + 1;
+    }
 
-struct client
+    memmove(client->in, client->in + start, end - start);
+    client->in_len = end - start;
+    return 1;
+}
+
+// returns 0 when the client went away and was closed
+int read_client(struct client * client)
 {
-    int socket_fd;
-    struct sockaddr_in addr;
-};
+    if (rooms)
+    {
+        return read_commands(client);
+    }
 
-struct context
+    char buffer[BUFFERSIZE];
+    ssize_t read_size = recv(client->socket_fd, buffer, sizeof(buffer), 0);
+    if (read_size > 0)
+    {
+        broadcast(client, buffer, read_size);
+    }
+    else if (read_size == 0)
+    {
+        close_client(client);
+        return 0;
+    }
+
+    return 1;
+}
+
+int context_init(struct shard * shard)
 {
-    struct client clients[MAXCLIENTS << 1];
-    int count;
-} ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.epoll_fd = -1;
+    ctx.shard = shard;
+    ctx.next_report = time(NULL) + REPORT_INTERVAL;
+    ctx.depths = malloc(sizeof(*ctx.depths));
+    if (ctx.depths == NULL)
+    {
+        return -1;
+    }
 
-//int setnonblocking(int sfd)
-//{
-//    int flags, s;
-//    flags = fcntl(sfd, F_GETFL, 0);
-//    if (flags == -1) { perror("fcntl"); return -1; }
-//    flags |= O_NONBLOCK;
-//    s = fcntl(sfd, F_SETFL, flags);
-//    if (s == -1) { perror("fcntl"); return -1; }
-//    return 0;
-//}
+    histogram_init(ctx.depths);
+    return 0;
+}
 
-void * thread_accept_func(void * args)
+// queue depth percentiles and slow consumer losses since the last report,
+// and the client that has lost the most so far. returns the milliseconds
+// until the next report is due.
+int report_queues(void)
 {
-    int socket = *(int *) args;
-    struct sockaddr_in addr;
-    socklen_t size = sizeof(addr);
-    while (1)
+    time_t now = time(NULL);
+    if (now < ctx.next_report)
     {
-        int client_fd = accept4(socket, &addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
-        if (client_fd > 0)
-        {
-            if (ctx.count >= MAXCLIENTS)
-            {
-                fprintf(stderr, "cannot accept new client %d.\n", client_fd);
-                shutdown(client_fd, SHUT_RDWR);
-                close(client_fd);
-            }
-            else
-            {
-                char addr_str[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &addr.sin_addr, addr_str, INET_ADDRSTRLEN);
-                printf("Accept from (%d) %s:%u\n", client_fd, addr_str, ntohs(addr.sin_port));
-                ctx.clients[ctx.count].addr = addr;
-                ctx.clients[ctx.count].socket_fd = client_fd;
-                ++ctx.count;
-            }
-        }
-        else
+        return (int) (ctx.next_report - now) * 1000;
+    }
+
+    ctx.next_report = now + REPORT_INTERVAL;
+    if (ctx.depths->count == 0 && ctx.dropped == 0 && ctx.disconnected == 0)
+    {
+        return REPORT_INTERVAL * 1000;
+    }
+
+    struct client * laggard = NULL;
+    for (size_t i = 0; i < ctx.count; ++i)
+    {
+        if (ctx.live[i]->dropped && (laggard == NULL || ctx.live[i]->dropped > laggard->dropped))
         {
-            printf("accept4: %d\n", client_fd);
+            laggard = ctx.live[i];
         }
     }
 
-    return NULL;
+    char name[32] = "";
+    if (ctx.shard)
+    {
+        snprintf(name, sizeof(name), "shard %u ", ctx.shard->id);
+    }
+
+    printf("%squeue depth p50 %lu p99 %lu p99.9 %lu max %lu, dropped %lu, disconnected %lu, most lagged %d (%lu)\n",
+           name, histogram_percentile(ctx.depths, 50), histogram_percentile(ctx.depths, 99),
+           histogram_percentile(ctx.depths, 99.9), ctx.depths->max, ctx.dropped, ctx.disconnected,
+           laggard ? laggard->socket_fd : -1, laggard ? laggard->dropped : 0);
+
+    histogram_init(ctx.depths);
+    ctx.dropped = 0;
+    ctx.disconnected = 0;
+    return REPORT_INTERVAL * 1000;
 }
 
-void close_client(int fd)
+// the same broadcaster on epoll: the listener and every client are registered
+// once, and each event carries its client, so a wakeup costs the same no
+// matter how many idle clients are connected.
+int epoll_loop(int server_socket)
 {
-    printf("close event on %d\n", fd);
-    shutdown(fd, SHUT_RDWR);
-    close(fd);
-    for (int j = 0; j < MAXCLIENTS; ++j)
+    ctx.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx.epoll_fd < 0)
+    {
+        fprintf(stderr, "failed to create epoll: %d %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;      // the listener is the only registration without a client
+    if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, server_socket, &event) < 0)
+    {
+        fprintf(stderr, "failed to add listener: %d %s\n", errno, strerror(errno));
+        close(ctx.epoll_fd);
+        ctx.epoll_fd = -1;
+        return -1;
+    }
+
+    if (ctx.shard)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = ctx.shard;
+        if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, ctx.shard->doorbell, &event) < 0)
+        {
+            fprintf(stderr, "failed to add doorbell: %d %s\n", errno, strerror(errno));
+            close(ctx.epoll_fd);
+            ctx.epoll_fd = -1;
+            return -1;
+        }
+    }
+
+    int timeout = -1;
+    while (1)
     {
-        if (ctx.clients[j].socket_fd == fd)
+        struct epoll_event events[MAXEVENTS];
+        int nfd = epoll_wait(ctx.epoll_fd, events, MAXEVENTS, timeout);
+        if (nfd < 0)
         {
-            ctx.clients[j].socket_fd = -1;
-            char addr_str[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ctx.clients[j].addr.sin_addr, addr_str, INET_ADDRSTRLEN);
-            printf("Disconnect from (%d) %s:%u\n", fd, addr_str, ntohs(ctx.clients[j].addr.sin_port));
-//                            memmove(&ctx.clients[j], &ctx.clients[j + 1], sizeof(struct client) * (ctx.count - j));
-            --ctx.count;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "failed to epoll_wait: %d %s\n", errno, strerror(errno));
             break;
         }
+
+        for (int i = 0; i < nfd; ++i)
+        {
+            struct client * client = events[i].data.ptr;
+            uint32_t revent = events[i].events;
+
+            if (client == NULL)
+            {
+                if (revent & (EPOLLHUP | EPOLLERR))
+                {
+                    fprintf(stderr, "listener socket hanged up!!\n");
+                    close(ctx.epoll_fd);
+                    ctx.epoll_fd = -1;
+                    return -1;
+                }
+
+                accept_clients(server_socket);
+                continue;
+            }
+
+            if (ctx.shard && events[i].data.ptr == ctx.shard)
+            {
+                drain_rings();
+                continue;
+            }
+
+            if (client->socket_fd < 0)
+            {
+                continue;       // closed earlier in this batch
+            }
+
+            if ((revent & (EPOLLOUT | EPOLLERR)) && client->want_write && client_flush(client) < 0)
+            {
+                close_client(client);
+                continue;
+            }
+
+            if (revent & EPOLLIN)
+            {
+                // drain what arrived before the hangup, recv sees the end of stream
+                read_client(client);
+            }
+            else if (revent & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                close_client(client);
+            }
+        }
+
+        release_closed();
+
+        timeout = report_queues();
+        if (ctx.shard)
+        {
+            for (unsigned int to = 0; to < shard_count; ++to)
+            {
+                if (ctx.shard->backlog[to].count && flush_backlog(to))
+                {
+                    ring_doorbell(&shards[to]);
+                }
+                if (ctx.shard->backlog[to].count)
+                {
+                    timeout = 1;    // a peer falling behind does not wake us when it catches up
+                }
+            }
+        }
     }
+
+    close(ctx.epoll_fd);
+    ctx.epoll_fd = -1;
+    return -1;
 }
 
-int main(void)
+// a nonblocking listener on PORT. shards each open their own with
+// SO_REUSEPORT and the kernel spreads the connections over them.
+int open_listener(int reuseport)
 {
-    pthread_t thread_accept;
-
-    printf("%s\n", ttyname(0));
-//    signal(SIGCHLD, SIG_IGN);
-
     int server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
     if (server_socket < 0)
     {
@@ -125,6 +1650,13 @@ int main(void)
         return -1;
     }
 
+    if (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &yes_1, sizeof(yes_1)) < 0)
+    {
+        fprintf(stderr, "failed set reuse port: %d %s\n", errno, strerror(errno));
+        close(server_socket);
+        return -1;
+    }
+
     struct sockaddr_in address;
     address.sin_family = AF_INET;
     address.sin_port = htons(PORT);
@@ -160,33 +1692,260 @@ int main(void)
         return -1;
     }
 
-    printf("Listening (%d)....\n", server_socket);
+    return server_socket;
+}
 
-    memset(&ctx, 0, sizeof(ctx));
+void * shard_thread(void * args)
+{
+    struct shard * shard = args;
+
+    if (context_init(shard) < 0)
+    {
+        fprintf(stderr, "failed to set up shard %u\n", shard->id);
+        __atomic_store_n(&shard->failed, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    int server_socket = open_listener(1);
+    if (server_socket >= 0)
+    {
+        printf("Shard %u listening (%d)....\n", shard->id, server_socket);
+        epoll_loop(server_socket);
+        close(server_socket);
+    }
+
+    // the other shards would keep pushing into rings nobody drains
+    __atomic_store_n(&shard->failed, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// clients partitioned over shard_count epoll threads. the main thread only
+// reports the fan-out rate, messages queued to clients over all shards.
+int run_shards(void)
+{
+    shards = calloc(shard_count, sizeof(*shards));
+    rings = calloc((size_t) shard_count * shard_count, sizeof(*rings));
+    if (shards == NULL || rings == NULL)
+    {
+        fprintf(stderr, "failed to allocate %u shards\n", shard_count);
+        return -1;
+    }
+
+    // every doorbell exists before any shard can ring it
+    for (unsigned int i = 0; i < shard_count; ++i)
+    {
+        shards[i].id = i;
+        shards[i].doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shards[i].doorbell < 0)
+        {
+            fprintf(stderr, "failed to create doorbell: %d %s\n", errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    for (unsigned int i = 0; i < shard_count; ++i)
+    {
+        if (pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]) != 0)
+        {
+            fprintf(stderr, "failed to start shard %u\n", i);
+            return -1;
+        }
+    }
+
+    unsigned long last = 0;
+    while (1)
+    {
+        sleep(1);
+
+        unsigned long total = 0;
+        for (unsigned int i = 0; i < shard_count; ++i)
+        {
+            if (__atomic_load_n(&shards[i].failed, __ATOMIC_ACQUIRE))
+            {
+                fprintf(stderr, "shard %u stopped, shutting down\n", i);
+                return -1;
+            }
+            total += __atomic_load_n(&shards[i].deliveries, __ATOMIC_RELAXED);
+        }
+        if (total != last)
+        {
+            printf("fan-out %lu deliveries/s\n", total - last);
+            last = total;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+//    pthread_t thread_accept;
+    int use_epoll = 0;
+    int log_level = RL_INFO;
+    int opt;
+
+    if (context_init(NULL) < 0)
+    {
+        return -1;
+    }
+
+    while ((opt = getopt(argc, argv, "em:t:Rb:n:d:H:S:y:jl:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'e':
+                use_epoll = 1;
+                break;
+            case 'm':
+                max_clients = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                rooms = 1;
+                break;
+            case 'b':
+                queue_max_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                queue_max_messages = strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                history_path = optarg;
+                break;
+            case 'S':
+                history_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'y':
+                history_sync = (unsigned int) atoi(optarg);
+                break;
+            case 'j':
+                replay_on_join = 1;
+                break;
+            case 'l':
+                log_level = ringlog_parse_level(optarg);
+                if (log_level < 0)
+                {
+                    fprintf(stderr, "unknown log level %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'd':
+                if (strcmp(optarg, "oldest") == 0)
+                {
+                    queue_policy = DROP_OLDEST;
+                }
+                else if (strcmp(optarg, "newest") == 0)
+                {
+                    queue_policy = DROP_NEWEST;
+                }
+                else if (strcmp(optarg, "disconnect") == 0)
+                {
+                    queue_policy = DISCONNECT;
+                }
+                else
+                {
+                    fprintf(stderr, "unknown queue policy %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                shard_count = (unsigned int) atoi(optarg);
+                if (shard_count > MAXSHARDS)
+                {
+                    fprintf(stderr, "at most %d shards\n", MAXSHARDS);
+                    return -1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-e] [-m max clients] [-t shards] [-R] [-b bytes] [-n messages] [-d policy] [-H history [-S size] [-y seconds] [-j]] [-l level]\n"
+                                "\t -e    persistent epoll interest set instead of rebuilding a pollfd array per poll\n"
+                                "\t -m    clients accepted at most, per shard when sharded, %d by default\n"
+                                "\t -t    shard the clients over this many epoll threads\n"
+                                "\t -R    rooms: SUB/UNSUB/PUB <topic> line commands, messages only reach subscribers\n"
+                                "\t -b    bytes a client may have queued, unlimited by default\n"
+                                "\t -n    messages a client may have queued, unlimited by default\n"
+                                "\t -d    over a limit: oldest (drop queued messages, default), newest (drop the new one) or disconnect\n"
+                                "\t -H    keep the messages in this memory-mapped ring file, HISTORY and REPLAY <offset> in rooms mode\n"
+                                "\t -S    history ring bytes, 64 MB by default\n"
+                                "\t -y    seconds between syncs of the history file, 0 leaves it to the kernel, 1 by default\n"
+                                "\t -j    raw mode: replay the whole history to every new client\n"
+                                "\t -l    debug, info (default), warn, error or off, logged off the event loop\n",
+                                argv[0], MAXCLIENTS);
+                return -1;
+        }
+    }
+
+    // every client is a descriptor, lift the soft limit as far as allowed
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("%s\n", ttyname(0));
+//    signal(SIGCHLD, SIG_IGN);
+
+    if (ringlog_start(STDOUT_FILENO, log_level, 100) < 0)
+    {
+        return -1;
+    }
+
+    if (history_path && history_open(&history, history_path, history_size, history_sync) < 0)
+    {
+        return -1;
+    }
+
+    if (shard_count)
+    {
+        return run_shards();
+    }
+
+    int server_socket = open_listener(0);
+    if (server_socket < 0)
+    {
+        return -1;
+    }
+
+    printf("Listening (%d)....\n", server_socket);
 
 //    pthread_create(&thread_accept, NULL, thread_accept_func, &server_socket);
 
-    int loop = 1;
+    int loop = !use_epoll;
+    if (use_epoll)
+    {
+        epoll_loop(server_socket);
+    }
+
+    struct pollfd * poll_fds = NULL;
+    size_t poll_capacity = 0;
     while (loop)
     {
-        struct pollfd poll_fds[(MAXCLIENTS << 1) + 1];
-        int count = 1;
+        size_t count = 1;
 
-        poll_fds[0].fd = server_socket;
-        poll_fds[0].events = POLLIN | POLLHUP;
-        for (int i = 0; i < MAXCLIENTS; ++i)
+        if (ctx.count + 1 > poll_capacity)
         {
-            if (ctx.clients[i].socket_fd > 0)
+            poll_capacity = ctx.capacity + 1;
+            struct pollfd * grown = realloc(poll_fds, poll_capacity * sizeof(*poll_fds));
+            if (grown == NULL)
             {
-//                printf("add %d on %d\n", ctx.clients[i].socket_fd, count);
-                poll_fds[count].fd = ctx.clients[i].socket_fd;
-                poll_fds[count].events = POLLIN | POLLRDHUP | POLLHUP | POLLERR | POLLREMOVE;
-                ++count;
+                fprintf(stderr, "failed to grow poll set to %zu\n", poll_capacity);
+                break;
             }
+            poll_fds = grown;
+        }
+
+        poll_fds[0].fd = server_socket;
+        poll_fds[0].events = POLLIN | POLLHUP;
+        for (size_t i = 0; i < ctx.count; ++i)
+        {
+//            printf("add %d on %d\n", ctx.live[i]->socket_fd, count);
+            poll_fds[count].fd = ctx.live[i]->socket_fd;
+            poll_fds[count].events = POLLIN | POLLRDHUP | POLLHUP | POLLERR | POLLREMOVE | (ctx.live[i]->want_write ? POLLOUT : 0);
+            ++count;
         }
 
-        printf("poll ... %d %d\n", count,  ctx.count);
-        int nfd = poll(poll_fds, count, -1);
+        rlog(RL_DEBUG, "poll ... %lu %lu\n", count, ctx.count);
+        int nfd = poll(poll_fds, count, report_queues());
         if (nfd < 0)
         {
             fprintf(stderr, "failed to poll: %d %s\n", errno, strerror(errno));
@@ -197,8 +1956,8 @@ int main(void)
             continue;
         }
 
-        printf("poll done ... %d\n", nfd);
-        for (int i = 0; i < count; ++i)
+        rlog(RL_DEBUG, "poll done ... %lu\n", nfd);
+        for (size_t i = 0; i < count; ++i)
         {
             int fd = poll_fds[i].fd;
             int revent = poll_fds[i].revents;
@@ -208,20 +1967,9 @@ int main(void)
                 continue;
             }
 
-            printf("fd: %d, revent: %X -> %s%s%s%s%s%s%s%s%s%s%s%s%s\n", fd, revent,
-                   (revent & POLLIN) ? "POLLIN ": "",
-                   (revent & POLLPRI) ? "POLLPRI ": "",
-                   (revent & POLLOUT) ? "POLLOUT ": "",
-                   (revent & POLLRDNORM) ? "POLLRDNORM ": "",
-                   (revent & POLLRDBAND) ? "POLLRDBAND ": "",
-                   (revent & POLLWRNORM) ? "POLLWRNORM ": "",
-                   (revent & POLLWRBAND) ? "POLLWRBAND ": "",
-                   (revent & POLLMSG) ? "POLLMSG ": "",
-                   (revent & POLLREMOVE) ? "POLLREMOVE ": "",
-                   (revent & POLLRDHUP) ? "POLLRDHUP ": "",
-                   (revent & POLLERR) ? "POLLERR ": "",
-                   (revent & POLLHUP) ? "POLLHUP ": "",
-                   (revent & POLLNVAL) ? "POLLNVAL ": "");
+            // the flag names are left to whoever reads the mask, decoding
+            // them here cost 13 branches and a long format on every event
+            rlog(RL_DEBUG, "fd: %lu, revent: %lX\n", fd, revent);
 
             if (fd == server_socket) // server sockets
             {
@@ -234,82 +1982,74 @@ int main(void)
 
                 if (revent & POLLIN)
                 {
-                    struct sockaddr_in addr;
-                    socklen_t size = sizeof(addr);
-                    while (1)
-                    {
-                        int client_fd = accept4(server_socket, &addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
-                        if (client_fd > 0)
-                        {
-                            if (ctx.count >= MAXCLIENTS)
-                            {
-                                fprintf(stderr, "cannot accept new client.\n");
-                                shutdown(client_fd, SHUT_RDWR);
-                                close(client_fd);
-                            }
-                            else
-                            {
-                                char addr_str[INET_ADDRSTRLEN];
-                                inet_ntop(AF_INET, &addr.sin_addr, addr_str, INET_ADDRSTRLEN);
-                                printf("Accept from (%d) %s:%u\n", client_fd, addr_str, ntohs(addr.sin_port));
-                                ctx.clients[ctx.count].addr = addr;
-                                ctx.clients[ctx.count].socket_fd = client_fd;
-                                ++ctx.count;
-                            }
-                        }
-                        else
-                        {
-                            printf("accept4: %d\n", client_fd);
-                            break;
-                        }
-                    }
+                    accept_clients(server_socket);
+                    continue;
                 }
 
-                printf("un handled revent on listener: %X\n", revent);
+                rlog(RL_WARN, "un handled revent on listener: %lX\n", revent);
             }
             else // client sockets
             {
+                struct client * client = client_find(fd);
+                if (client == NULL)
+                {
+                    continue;
+                }
+
                 if ((revent & POLLRDHUP) || (revent & POLLHUP))
                 {
-                    close_client(fd);
+                    close_client(client);
+                    continue;
+                }
+
+                if ((revent & POLLOUT) && client_flush(client) < 0)
+                {
+                    close_client(client);
                     continue;
                 }
 
                 if (revent & POLLIN)
                 {
-                    char buffer[BUFFERSIZE];
-                    ssize_t read_size = recv(fd, buffer, sizeof(buffer), 0);
-                    if (read_size > 0)
-                    {
-                        for (int j = 0; j < ctx.count; ++j)
-                        {
-                            if (ctx.clients[j].socket_fd != fd)
-                            {
-                                send(ctx.clients[j].socket_fd, buffer, read_size, MSG_NOSIGNAL);
-                            }
-                        }
-                    }
-                    else if (read_size == 0)
-                    {
-                        close_client(fd);
-                    }
+                    read_client(client);
+                    continue;
+                }
 
+                if (revent & POLLOUT)
+                {
                     continue;
                 }
 
-                printf("un handled revent on client: %X\n", revent);
+                rlog(RL_WARN, "un handled revent on client: %lX\n", revent);
             }
         }
+
+        release_closed();
     }
 
+    free(poll_fds);
+
 //    pthread_cancel(thread_accept);
 //    pthread_kill(thread_accept, SIGKILL);
 
     close(server_socket);
-    for (int i = 0; i < ctx.count; ++i)
+    while (ctx.count)
+    {
+        struct client * client = ctx.live[0];
+        while (client->queue.count)
+        {
+            client_dequeue(client);
+        }
+        close(client->socket_fd);
+        client_remove(client);
+    }
+    release_closed();
+    free(ctx.live);
+    free(ctx.by_fd);
+    if (history_path)
     {
-        close(ctx.clients[i].socket_fd);
+        history_close(&history);
     }
+    ringlog_stop();
 
     return 0;
 }
@@ -1,170 +1,2085 @@
+/*
+build:
+gcc -O2 -Wall -pthread -I.. main.c server.c conn.c timer-wheel.c frame.c handoff.c mailbox.c workers.c uring.c udp.c ../ringlog.c -o server
+*/
+
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <limits.h>
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+
+#include "conn.h"
+#include "server.h"
+#include "ringlog.h"
+
+#define POLLSIZE        256
+#define READ_BUDGET     (256 * 1024)    // bytes read from one connection per wakeup in edge mode
+#define HIGH_WATER      (1024 * 1024)   // queued output bytes at which a client stops being read
+#define TICK_MS         100             // timer wheel resolution
+#define IDLE_MS         60000           // close clients without any traffic for this long
+#define HEADER_MS       10000           // close clients that send no request this long after connecting
+#define WRITE_MS        30000           // close clients that do not take pending output for this long
+#define STATS_MS        1000
+#define SPIN_US         50              // busy-poll interval the ping-pong benchmark uses when -s is not given
+#define PINGPONG_WARMUP 1000
+#define PINGPONG_SIZE   64
+
+// epoll busy-poll parameters, only in uapi headers since 6.9
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS    _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+pthread_t server;
+
+void print_help()
+{
+    printf("options\n"
+           "\t -u, --uring              use the io_uring backend instead of epoll\n"
+           "\t -e, --edge               register sockets edge-triggered and drain them until EAGAIN\n"
+           "\t -b, --budget             bytes read from one client per wakeup in edge mode\n"
+           "\t -w, --high-water         queued output bytes at which a client stops being read\n"
+           "\t -i, --idle-timeout       ms without traffic before a client is closed, 0 disables\n"
+           "\t -r, --header-timeout     ms after accept for the first request to arrive, 0 disables\n"
+           "\t -o, --write-timeout      ms pending output may make no progress, 0 disables\n"
+           "\t -k, --tick               timer resolution in ms\n"
+           "\t -f, --file               answer every request line with this file instead of echoing\n"
+           "\t -m, --payload-mode       how the file is sent: copy, sendfile or zerocopy\n"
+           "\t -F, --framing            fixed or varint length-prefixed frames instead of a byte stream\n"
+           "\t -s, --spin               busy-poll: spin this many us on epoll_wait before blocking\n"
+           "\t -P, --pingpong           measure loopback round trips, blocking and busy-poll, and exit\n"
+           "\t -H, --handoff            unix socket path for hot restarts, takes over from a server listening there\n"
+           "\t -C, --handoff-clients    take over the running server's clients too, not just its listener\n"
+           "\t -U, --udp                echo udp datagrams with recvmmsg/sendmmsg instead of serving tcp\n"
+           "\t -t, --threads            udp sockets and workers, one per cpu by default\n"
+           "\t -g, --gro                receive coalesced datagrams with UDP_GRO\n"
+           "\t -G, --gso                reply to coalesced datagrams in one send with UDP_SEGMENT\n"
+           "\t -W, --workers            answer from this many worker threads through the reactor mailbox\n"
+           "\t -l, --log-level          debug, info (default), warn, error or off, logged off the event loop\n"
+           );
+}
+
+static struct option long_options[] =
+{
+        {"uring", no_argument, 0, 'u'},
+        {"edge", no_argument, 0, 'e'},
+        {"budget", required_argument, 0, 'b'},
+        {"high-water", required_argument, 0, 'w'},
+        {"idle-timeout", required_argument, 0, 'i'},
+        {"header-timeout", required_argument, 0, 'r'},
+        {"write-timeout", required_argument, 0, 'o'},
+        {"tick", required_argument, 0, 'k'},
+        {"file", required_argument, 0, 'f'},
+        {"payload-mode", required_argument, 0, 'm'},
+        {"framing", required_argument, 0, 'F'},
+        {"spin", required_argument, 0, 's'},
+        {"pingpong", required_argument, 0, 'P'},
+        {"handoff", required_argument, 0, 'H'},
+        {"handoff-clients", no_argument, 0, 'C'},
+        {"udp", no_argument, 0, 'U'},
+        {"threads", required_argument, 0, 't'},
+        {"gro", no_argument, 0, 'g'},
+        {"gso", no_argument, 0, 'G'},
+        {"workers", required_argument, 0, 'W'},
+        {"log-level", required_argument, 0, 'l'},
+        {0, 0, 0, 0},
+};
+
+struct server_config config;
+struct server_stats stats;
+
+struct pool conn_pool;
+struct pool buffer_pool;
+struct pool segment_pool;
+
+// all deadlines share one wheel driven by a periodic timerfd, so any number of
+// armed timers costs a single read per tick
+struct timer_wheel wheel;
+static struct timer stats_timer;
+
+const struct handler * handler;
+const struct handler * application;     // receives frames when framing is on
+const struct backend * backend = &epoll_backend;
+
+static int epoll_fd = -1;
+
+// open clients in no particular order
+struct conn * live_conns;
+
+// other threads hand work to the reactor here
+struct mailbox mailbox = {.fd = -1};
+
+// clients that got output from posts during a drain, flushed once at its end
+static struct conn * flush_list;
+
+// listener and clients received from the previous process on a hot restart,
+// and whether this process handed its own to a successor and is winding down
+static int inherited_listener = -1;
+static struct conn * adopted;
+static int draining;
+
+// held open so that out of descriptors, one can be freed to accept and
+// close a pending client instead of leaving it queued on the listener
+static int reserve_fd = -1;
+
+static struct
+{
+    int fd;
+    const char * data;          // whole file mapped read-only
+    size_t len;
+} payload = {-1, NULL, 0};
+
+// connections closed while handling a batch are only recycled after the batch,
+// a later event in the same batch may still point at them
+static struct conn * release_list;
+
+// edge-triggered connections that ran out of budget with data possibly left in
+// the socket, epoll will not report them again so they are revisited by hand
+static struct conn * ready_list;
+
+uint64_t ms_to_ticks(unsigned int ms)
+{
+    return (ms + config.tick_ms - 1) / config.tick_ms;
+}
+
+int open_listener(int flags)
+{
+    if (inherited_listener >= 0)
+    {
+        int server_socket = inherited_listener;
+        inherited_listener = -1;
+
+        int fl = fcntl(server_socket, F_GETFL);
+        fcntl(server_socket, F_SETFL, (flags & SOCK_NONBLOCK) ? fl | O_NONBLOCK : fl & ~O_NONBLOCK);
+        return server_socket;
+    }
+
+    int server_socket = socket(AF_INET, SOCK_STREAM | flags, IPPROTO_IP);
+    if (server_socket < 0)
+    {
+        perror("server < 0\n");
+        return -1;
+    }
+
+    int yes_1 = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes_1, sizeof(yes_1)) < 0)
+    {
+        perror("setsockopt reuse address < 0\n");
+        close(server_socket);
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT);
+    address.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(server_socket, (struct sockaddr*) &address, sizeof(address)) < 0)
+    {
+        perror("bind server < 0\n");
+        close(server_socket);
+        return -1;
+    }
+
+    if (listen(server_socket, BACKLOG) < 0)
+    {
+        perror("listen < 0\n");
+        close(server_socket);
+        return -1;
+    }
+
+    return server_socket;
+}
+
+int open_ticker(int flags)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, flags);
+    if (fd < 0)
+    {
+        perror("timerfd_create < 0\n");
+        return -1;
+    }
+
+    struct itimerspec tick;
+    tick.it_interval.tv_sec = config.tick_ms / 1000;
+    tick.it_interval.tv_nsec = (config.tick_ms % 1000) * 1000000L;
+    tick.it_value = tick.it_interval;
+
+    if (timerfd_settime(fd, 0, &tick, NULL) < 0)
+    {
+        perror("timerfd_settime < 0\n");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static struct segment * new_segment(struct conn * conn)
+{
+    struct segment * segment = pool_get(&segment_pool);
+    if (segment == NULL)
+    {
+        return NULL;
+    }
+
+    memset(segment, 0, sizeof(*segment));
+    segment->file_fd = -1;
+    *conn->out_tail = segment;
+    conn->out_tail = &segment->next;
+    return segment;
+}
+
+static void release_segment(struct segment * segment)
+{
+    if (segment->buffer)
+    {
+        pool_put(&buffer_pool, segment->buffer);
+    }
+
+    pool_put(&segment_pool, segment);
+}
+
+// the idle deadline is not moved on every read or write, it only compares
+// last_active when it fires and re-arms itself for the remainder
+static void idle_expired(struct timer_wheel * wheel, struct timer * timer)
+{
+    struct conn * conn = container_of(timer, struct conn, idle_timer);
+    uint64_t idle = wheel->now - conn->last_active;
+    uint64_t limit = ms_to_ticks(config.idle_ms);
+
+    if (idle < limit)
+    {
+        timer_arm(wheel, timer, limit - idle);
+        return;
+    }
+
+    ++stats.timeouts;
+    rlog(RL_INFO, "client %lu idle timeout\n", conn->fd);
+    backend->close(conn);
+}
+
+static void header_expired(struct timer_wheel * wheel, struct timer * timer)
+{
+    struct conn * conn = container_of(timer, struct conn, header_timer);
+    (void) wheel;
+    ++stats.timeouts;
+    rlog(RL_INFO, "client %lu header timeout\n", conn->fd);
+    backend->close(conn);
+}
+
+static void write_expired(struct timer_wheel * wheel, struct timer * timer)
+{
+    struct conn * conn = container_of(timer, struct conn, write_timer);
+    (void) wheel;
+    ++stats.timeouts;
+    rlog(RL_INFO, "client %lu write timeout with %lu bytes pending\n", conn->fd, conn->out_bytes);
+    backend->close(conn);
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void stats_expired(struct timer_wheel * wheel, struct timer * timer)
+{
+    static unsigned long reported;
+    static unsigned long last_bytes;
+    static double last_cpu;
+    unsigned long activity = stats.accepts + stats.recv_calls + stats.send_calls + stats.timeouts;
+
+    if (activity != reported)
+    {
+        reported = activity;
+        printf("%s: wakeups %lu, accepts %lu, recv calls %lu, recv bytes %lu (%.1f bytes/recv), "
+               "send calls %lu, send bytes %lu (%.1f bytes/send), pauses %lu, timeouts %lu, clients %lu\n",
+               backend->name, stats.wakeups, stats.accepts, stats.recv_calls, stats.recv_bytes,
+               stats.recv_calls ? (double) stats.recv_bytes / stats.recv_calls : 0.0,
+               stats.send_calls, stats.send_bytes,
+               stats.send_calls ? (double) stats.send_bytes / stats.send_calls : 0.0,
+               stats.pauses, stats.timeouts, stats.clients);
+
+        // cpu per byte over the last interval is what tells the payload modes apart
+        double cpu = cpu_seconds();
+        unsigned long bytes = stats.send_bytes - last_bytes;
+        printf("  send %.1f MB/s, cpu %.3f s, %.3f ns/byte, sendfile calls %lu, "
+               "zerocopy sends %lu, completions %lu, copied %lu, no buffers %lu\n",
+               bytes / (STATS_MS / 1000.0) / 1e6, cpu - last_cpu,
+               bytes ? (cpu - last_cpu) * 1e9 / bytes : 0.0, stats.sendfile_calls,
+               stats.zc_sends, stats.zc_completions, stats.zc_copied, stats.zc_nobufs);
+        if (stats.posts)
+        {
+            printf("  mailbox wakeups %lu, posts %lu (%.1f posts/wakeup), stale %lu\n",
+                   stats.mailbox_wakeups, stats.posts,
+                   stats.mailbox_wakeups ? (double) stats.posts / stats.mailbox_wakeups : 0.0, stats.stale_posts);
+        }
+        if (config.spin_us)
+        {
+            printf("  spin polls %lu, spin hits %lu (%.1f%% of wakeups)\n", stats.spin_polls, stats.spin_hits,
+                   stats.wakeups ? 100.0 * stats.spin_hits / stats.wakeups : 0.0);
+        }
+        if (stats.accept_shed)
+        {
+            printf("  shed %lu clients while out of descriptors\n", stats.accept_shed);
+        }
+        if (config.framing != FRAME_NONE)
+        {
+            printf("  frames %lu (%.1f frames/pass)\n", stats.frames,
+                   stats.frame_passes ? (double) stats.frames / stats.frame_passes : 0.0);
+        }
+        last_bytes = stats.send_bytes;
+        last_cpu = cpu;
+    }
+
+    timer_arm(wheel, timer, ms_to_ticks(STATS_MS));
+}
+
+void start_timers(void)
+{
+    timer_wheel_init(&wheel, NULL);
+    timer_init(&stats_timer, stats_expired);
+    timer_arm(&wheel, &stats_timer, ms_to_ticks(STATS_MS));
+}
+
+// common bookkeeping for a freshly accepted client, before any I/O on it
+void conn_open(struct conn * conn)
+{
+    ++stats.accepts;
+    ++stats.clients;
+
+    conn->kind = CONN_CLIENT;
+    clock_gettime(CLOCK_MONOTONIC, &conn->accepted);
+    conn->last_active = wheel.now;
+
+    conn->live_next = live_conns;
+    if (conn->live_next)
+    {
+        conn->live_next->live_pprev = &conn->live_next;
+    }
+    conn->live_pprev = &live_conns;
+    live_conns = conn;
+
+    timer_init(&conn->idle_timer, idle_expired);
+    timer_init(&conn->header_timer, header_expired);
+    timer_init(&conn->write_timer, write_expired);
+    if (config.idle_ms)
+    {
+        timer_arm(&wheel, &conn->idle_timer, ms_to_ticks(config.idle_ms));
+    }
+    if (config.header_ms)
+    {
+        timer_arm(&wheel, &conn->header_timer, ms_to_ticks(config.header_ms));
+    }
+
+    if (handler->on_open)
+    {
+        handler->on_open(conn);
+    }
+}
+
+// common teardown once the backend no longer references the socket's memory
+void conn_closed(struct conn * conn)
+{
+    --stats.clients;
+    ++conn->generation;
+
+    *conn->live_pprev = conn->live_next;
+    if (conn->live_next)
+    {
+        conn->live_next->live_pprev = conn->live_pprev;
+    }
+
+    if (handler->on_close)
+    {
+        handler->on_close(conn);
+    }
+
+    timer_cancel(&wheel, &conn->idle_timer);
+    timer_cancel(&wheel, &conn->header_timer);
+    timer_cancel(&wheel, &conn->write_timer);
+    conn_free_buffers(conn);
+}
+
+// return the read buffer and every output segment to their pools
+void conn_free_buffers(struct conn * conn)
+{
+    if (conn->rbuf)
+    {
+        pool_put(&buffer_pool, conn->rbuf);
+        conn->rbuf = NULL;
+    }
+
+    while (conn->out_head)
+    {
+        struct segment * next = conn->out_head->next;
+        release_segment(conn->out_head);
+        conn->out_head = next;
+    }
+    conn->out_tail = &conn->out_head;
+    conn->out_bytes = 0;
+
+    // completions can no longer arrive and the kernel keeps the pages pinned
+    // until it drops the skbs. that is only harmless because zerocopy is used
+    // for the read-only payload mapping alone, never for memory we rewrite.
+    while (conn->zc_head)
+    {
+        struct segment * next = conn->zc_head->next;
+        release_segment(conn->zc_head);
+        conn->zc_head = next;
+    }
+    conn->zc_tail = &conn->zc_head;
+}
+
+// offer everything pending in conn->rbuf to the handler and move whatever it
+// did not consume to the front of the buffer
+int conn_process(struct conn * conn)
+{
+    struct buffer * rbuf = conn->rbuf;
+
+    ssize_t used = handler->on_data(conn, rbuf->data, rbuf->len);
+    if (used < 0)
+    {
+        return -1;
+    }
+
+    if ((size_t) used < rbuf->len)
+    {
+        if (used == 0 && rbuf->len == BUFFER_SIZE)
+        {
+            fprintf(stderr, "client %d message does not fit a buffer\n", conn->fd);
+            return -1;
+        }
+
+        memmove(rbuf->data, rbuf->data + used, rbuf->len - used);
+    }
+    rbuf->len -= used;
+    return 0;
+}
+
+// deliver bytes that were received outside conn->rbuf. when nothing is pending
+// they go to the handler where they lie and only an unconsumed tail is copied.
+int conn_receive(struct conn * conn, const char * data, size_t len)
+{
+    while (len > 0)
+    {
+        if (conn->rbuf == NULL || conn->rbuf->len == 0)
+        {
+            ssize_t used = handler->on_data(conn, data, len);
+            if (used < 0)
+            {
+                return -1;
+            }
+
+            data += used;
+            len -= used;
+            if (len == 0)
+            {
+                break;
+            }
+
+            if (len > BUFFER_SIZE)
+            {
+                fprintf(stderr, "client %d message does not fit a buffer\n", conn->fd);
+                return -1;
+            }
+
+            if (conn->rbuf == NULL && (conn->rbuf = buffer_get(&buffer_pool)) == NULL)
+            {
+                return -1;
+            }
+
+            memcpy(conn->rbuf->data, data, len);
+            conn->rbuf->len = len;
+            return 0;
+        }
+
+        size_t room = BUFFER_SIZE - conn->rbuf->len;
+        size_t count = len < room ? len : room;
+        memcpy(conn->rbuf->data + conn->rbuf->len, data, count);
+        conn->rbuf->len += count;
+        data += count;
+        len -= count;
+
+        if (conn_process(conn) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (conn->rbuf && conn->rbuf->len == 0)
+    {
+        pool_put(&buffer_pool, conn->rbuf);
+        conn->rbuf = NULL;
+    }
+
+    return 0;
+}
+
+// copy data to the end of the output queue. it is appended to the pooled
+// buffer at the tail while that has room and is not handed to the kernel yet,
+// so a stream of small writes turns into few large segments.
+int conn_send(struct conn * conn, const void * data, size_t len)
+{
+    const char * bytes = data;
+
+    while (len > 0)
+    {
+        struct segment * tail = conn->out_head ? container_of(conn->out_tail, struct segment, next) : NULL;
+        if (tail == NULL || tail->buffer == NULL || tail->busy ||
+            tail->data + tail->len != tail->buffer->data + tail->buffer->len ||
+            tail->buffer->len == BUFFER_SIZE)
+        {
+            struct buffer * buffer = buffer_get(&buffer_pool);
+            if (buffer == NULL)
+            {
+                return -1;
+            }
+
+            tail = new_segment(conn);
+            if (tail == NULL)
+            {
+                pool_put(&buffer_pool, buffer);
+                return -1;
+            }
+
+            tail->data = buffer->data;
+            tail->buffer = buffer;
+        }
+
+        size_t room = BUFFER_SIZE - tail->buffer->len;
+        size_t count = len < room ? len : room;
+        memcpy(tail->buffer->data + tail->buffer->len, bytes, count);
+        tail->buffer->len += count;
+        tail->len += count;
+        conn->out_bytes += count;
+        bytes += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+// queue memory the caller keeps alive and unchanged until the connection is
+// done with it, no bytes are copied. zerocopy asks for MSG_ZEROCOPY where the
+// socket supports it.
+int conn_send_ref(struct conn * conn, const void * data, size_t len, int zerocopy)
+{
+    struct segment * segment = new_segment(conn);
+    if (segment == NULL)
+    {
+        return -1;
+    }
+
+    segment->data = data;
+    segment->len = len;
+    segment->zerocopy = zerocopy && conn->zc_enabled;
+    conn->out_bytes += len;
+    return 0;
+}
+
+// queue len bytes of an open file, sent with sendfile() from the page cache
+int conn_send_file(struct conn * conn, int fd, off_t offset, size_t len)
+{
+    struct segment * segment = new_segment(conn);
+    if (segment == NULL)
+    {
+        return -1;
+    }
+
+    segment->file_fd = fd;
+    segment->file_offset = offset;
+    segment->len = len;
+    conn->out_bytes += len;
+    return 0;
+}
+
+struct conn_ref conn_ref_get(struct conn * conn)
+{
+    struct conn_ref ref = {conn, conn->generation};
+    return ref;
+}
+
+struct conn * conn_ref_resolve(struct conn_ref ref)
+{
+    if (ref.conn == NULL || ref.conn->generation != ref.generation || ref.conn->closing)
+    {
+        return NULL;
+    }
+
+    return ref.conn;
+}
+
+void reactor_post(struct post * post)
+{
+    mailbox_post(&mailbox, post);
+}
+
+// output posted by another thread, one allocation carrying the bytes
+struct response
+{
+    struct post post;
+    struct conn_ref ref;
+    size_t len;
+    char data[];
+};
+
+static void deliver_response(struct post * post)
+{
+    struct response * response = container_of(post, struct response, post);
+    struct conn * conn = conn_ref_resolve(response->ref);
+
+    if (conn == NULL)
+    {
+        ++stats.stale_posts;
+    }
+    else if (conn_send(conn, response->data, response->len) < 0)
+    {
+        fprintf(stderr, "no output buffer for client %d\n", conn->fd);
+        backend->close(conn);
+    }
+    else if (!conn->flush_queued)
+    {
+        conn->flush_queued = 1;
+        conn->flush_generation = conn->generation;
+        conn->flush_next = flush_list;
+        flush_list = conn;
+    }
+
+    free(response);
+}
+
+int reactor_send(struct conn_ref ref, const void * data, size_t len)
+{
+    struct response * response = malloc(sizeof(*response) + len);
+    if (response == NULL)
+    {
+        return -1;
+    }
+
+    response->post.fn = deliver_response;
+    response->ref = ref;
+    response->len = len;
+    memcpy(response->data, data, len);
+    reactor_post(&response->post);
+    return 0;
+}
+
+// a burst of responses for one client costs a single flush
+void reactor_drain(void)
+{
+    stats.posts += mailbox_drain(&mailbox);
+
+    while (flush_list)
+    {
+        struct conn * conn = flush_list;
+        flush_list = conn->flush_next;
+        conn->flush_queued = 0;
+
+        // a later post in the same drain may have closed it
+        struct conn_ref ref = {conn, conn->flush_generation};
+        if (conn_ref_resolve(ref))
+        {
+            backend->flush(conn);
+        }
+    }
+}
+
+// account for bytes the kernel took from the front of the output queue and
+// release every segment that went out completely. zerocopy segments still
+// belong to the kernel at that point and wait on the completion list.
+void conn_consume_output(struct conn * conn, size_t sent)
+{
+    stats.send_bytes += sent;
+    conn->out_bytes -= sent;
+    conn->last_active = wheel.now;
+
+    while (sent > 0)
+    {
+        struct segment * segment = conn->out_head;
+        if (sent < segment->len)
+        {
+            if (segment->file_fd < 0)
+            {
+                segment->data += sent;
+            }
+            segment->len -= sent;
+            break;
+        }
+
+        sent -= segment->len;
+        conn->out_head = segment->next;
+        if (conn->out_head == NULL)
+        {
+            conn->out_tail = &conn->out_head;
+        }
+
+        if (segment->zerocopy)
+        {
+            segment->next = NULL;
+            *conn->zc_tail = segment;
+            conn->zc_tail = &segment->next;
+        }
+        else
+        {
+            release_segment(segment);
+        }
+    }
+
+    if (conn->out_head == NULL)
+    {
+        timer_cancel(&wheel, &conn->write_timer);
+    }
+    else if (config.write_ms)
+    {
+        timer_arm(&wheel, &conn->write_timer, ms_to_ticks(config.write_ms));
+    }
+    if (handler->on_drain && conn->out_bytes < config.high_water / 2)
+    {
+        handler->on_drain(conn);
+    }
+}
+
+static ssize_t echo_data(struct conn * conn, const char * data, size_t len)
+{
+    if (conn_send(conn, data, len) < 0)
+    {
+        fprintf(stderr, "no output buffer for client %d\n", conn->fd);
+        return -1;
+    }
+
+    return len;
+}
+
+static int echo_frame(struct conn * conn, const char * data, size_t len)
+{
+    char header[FRAME_HEADER_MAX];
+    size_t size = frame_encode(config.framing, header, len);
+
+    if (conn_send(conn, header, size) < 0 || conn_send(conn, data, len) < 0)
+    {
+        fprintf(stderr, "no output buffer for client %d\n", conn->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const struct handler echo_handler =
+{
+    .on_data = echo_data,
+    .on_frame = echo_frame,
+};
+
+static int send_payload(struct conn * conn)
+{
+    int ret;
+    switch (config.payload_mode)
+    {
+        case PAYLOAD_SENDFILE:
+            ret = conn_send_file(conn, payload.fd, 0, payload.len);
+            break;
+        case PAYLOAD_ZEROCOPY:
+            ret = conn_send_ref(conn, payload.data, payload.len, 1);
+            break;
+        default:
+            ret = conn_send_ref(conn, payload.data, payload.len, 0);
+            break;
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "no segment for client %d\n", conn->fd);
+    }
+    return ret;
+}
+
+// every newline the client sends is a request for the whole payload file
+static ssize_t payload_data(struct conn * conn, const char * data, size_t len)
+{
+    for (const char * end = data + len; (data = memchr(data, '\n', end - data)) != NULL; ++data)
+    {
+        if (send_payload(conn) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+// with framing every frame is a request, the payload goes back unframed
+static int payload_frame(struct conn * conn, const char * data, size_t len)
+{
+    (void) data;
+    (void) len;
+    return send_payload(conn);
+}
+
+static const struct handler payload_handler =
+{
+    .on_data = payload_data,
+    .on_frame = payload_frame,
+};
+
+// framing layer between the backends and the application. every complete
+// frame in the buffer is handed over where it lies, all of them in one pass,
+// and only a trailing partial frame is left for conn_process to move to the
+// front of the buffer. a frame has to fit one read buffer.
+static ssize_t frame_data(struct conn * conn, const char * data, size_t len)
+{
+    size_t used = 0;
+    unsigned long frames = stats.frames;
+
+    while (used < len)
+    {
+        size_t body;
+        int header = frame_header(config.framing, data + used, len - used, &body);
+        if (header < 0)
+        {
+            fprintf(stderr, "client %d sent a malformed frame header\n", conn->fd);
+            return -1;
+        }
+        if (header == 0)
+        {
+            break;
+        }
+
+        // a complete header is what counts as the request having started
+        timer_cancel(&wheel, &conn->header_timer);
+
+        if (body > (size_t) (BUFFER_SIZE - header))
+        {
+            fprintf(stderr, "client %d frame of %zu bytes does not fit a buffer\n", conn->fd, body);
+            return -1;
+        }
+        if (len - used - header < body)
+        {
+            break;
+        }
+
+        if (application->on_frame(conn, data + used + header, body) < 0)
+        {
+            return -1;
+        }
+
+        ++stats.frames;
+        used += header + body;
+    }
+
+    if (stats.frames != frames)
+    {
+        ++stats.frame_passes;
+    }
+    return used;
+}
+
+static const struct handler frame_handler =
+{
+    .on_data = frame_data,
+};
+
+static int load_payload(const char * path)
+{
+    payload.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (payload.fd < 0)
+    {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(payload.fd, &st) < 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "cannot use %s as payload\n", path);
+        close(payload.fd);
+        return -1;
+    }
+
+    payload.len = st.st_size;
+    payload.data = mmap(NULL, payload.len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, payload.fd, 0);
+    if (payload.data == MAP_FAILED)
+    {
+        perror("mmap payload");
+        close(payload.fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void unload_payload(void)
+{
+    if (payload.fd >= 0)
+    {
+        munmap((void *) payload.data, payload.len);
+        close(payload.fd);
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// let recv poll the device queue instead of sleeping for an interrupt. the
+// kernel only lowers the limit without CAP_NET_ADMIN, and it has no effect on
+// loopback or devices without NAPI, so failures are not fatal.
+static void set_busy_poll(int fd, unsigned int usecs)
+{
+    int value = usecs;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+    value = usecs != 0;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value));
+}
+
+// closing marks it for posts still in flight and keeps a second close, say
+// from a flush after a failed post, from tearing it down twice
+static void close_conn(struct conn * conn)
+{
+    if (conn->closing)
+    {
+        return;
+    }
+
+    rlog(RL_DEBUG, "client %lu closing\n", conn->fd);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) < 0)
+    {
+        perror("epoll_ctl del client < 0\n");
+    }
+
+    close(conn->fd);
+    conn->fd = -1;
+    conn->closing = 1;
+    conn_closed(conn);
+
+    conn->next = release_list;
+    release_list = conn;
+}
+
+static void release_closed(void)
+{
+    while (release_list)
+    {
+        struct conn * next = release_list->next;
+        pool_put(&conn_pool, release_list);
+        release_list = next;
+    }
+}
+
+static void mark_ready(struct conn * conn)
+{
+    if (!conn->ready)
+    {
+        conn->ready = 1;
+        conn->ready_next = ready_list;
+        ready_list = conn;
+    }
+}
+
+// EPOLLIN is dropped while a client is paused by backpressure and EPOLLOUT is
+// only armed while output is queued, so an idle writable socket never wakes us
+static int update_interest(struct conn * conn)
+{
+    uint32_t events = EPOLLHUP | EPOLLRDHUP | (config.edge ? EPOLLET : 0);
+    if (!conn->paused)
+    {
+        events |= EPOLLIN;
+    }
+    if (conn->out_head)
+    {
+        events |= EPOLLOUT;
+    }
+
+    if (events == conn->events)
+    {
+        return 0;
+    }
+
+    struct epoll_event epoll_temp;
+    epoll_temp.events = events;
+    epoll_temp.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &epoll_temp) < 0)
+    {
+        perror("epoll_ctl mod client < 0\n");
+        return -1;
+    }
+
+    conn->events = events;
+    return 0;
+}
+
+// the error queue of a zerocopy socket reports ranges of finished send ids,
+// in order, and every segment whose last send is covered can be recycled
+static void reap_zerocopy(struct conn * conn)
+{
+    while (1)
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            break;
+        }
+
+        for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+
+            struct sock_extended_err * serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            uint32_t hi = serr->ee_data;
+            stats.zc_completions += hi - serr->ee_info + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                ++stats.zc_copied;
+            }
+
+            while (conn->zc_head && (int32_t) (conn->zc_head->zc_seq - hi) <= 0)
+            {
+                struct segment * segment = conn->zc_head;
+                conn->zc_head = segment->next;
+                release_segment(segment);
+            }
+            if (conn->zc_head == NULL)
+            {
+                conn->zc_tail = &conn->zc_head;
+            }
+        }
+    }
+}
+
+// write as much of the output queue as the socket takes and release every
+// segment that went out completely. file segments go out one sendfile() at a
+// time, runs of memory segments with the same zerocopy setting are gathered
+// into one sendmsg of up to IOV_MAX entries.
+static int flush_conn(struct conn * conn)
+{
+    static struct iovec iov[IOV_MAX];
+
+    while (conn->out_head)
+    {
+        ssize_t sent;
+        struct segment * first = conn->out_head;
+
+        if (first->file_fd >= 0)
+        {
+            sent = sendfile(conn->fd, first->file_fd, &first->file_offset, first->len);
+            ++stats.sendfile_calls;
+        }
+        else
+        {
+            int count = 0;
+            for (struct segment * segment = first;
+                 segment && count < IOV_MAX && segment->file_fd < 0 && segment->zerocopy == first->zerocopy;
+                 segment = segment->next)
+            {
+                iov[count].iov_base = (void *) segment->data;
+                iov[count].iov_len = segment->len;
+                ++count;
+            }
+
+            struct msghdr msg = {0};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+
+            sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (first->zerocopy ? MSG_ZEROCOPY : 0));
+            if (sent >= 0 && first->zerocopy)
+            {
+                struct segment * segment = first;
+                for (int i = 0; i < count; ++i, segment = segment->next)
+                {
+                    segment->zc_seq = conn->zc_next;
+                }
+                ++conn->zc_next;
+                ++stats.zc_sends;
+            }
+        }
+
+        ++stats.send_calls;
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == ENOBUFS && first->file_fd < 0 && first->zerocopy)
+            {
+                // the socket's optmem is held by notifications not yet reaped,
+                // this run goes out as a plain copy instead
+                for (struct segment * segment = first; segment && segment->file_fd < 0 && segment->zerocopy;
+                     segment = segment->next)
+                {
+                    segment->zerocopy = 0;
+                }
+                ++stats.zc_nobufs;
+                continue;
+            }
+
+            fprintf(stderr, "client %d send %s\n", conn->fd, strerror(errno));
+            close_conn(conn);
+            return -1;
+        }
+
+        conn_consume_output(conn, sent);
+    }
+
+    if (conn->out_head && config.write_ms && !timer_armed(&conn->write_timer))
+    {
+        timer_arm(&wheel, &conn->write_timer, ms_to_ticks(config.write_ms));
+    }
+
+    if (conn->paused && conn->out_bytes <= config.high_water / 2)
+    {
+        conn->paused = 0;
+        mark_ready(conn); // data may have piled up in the socket while paused
+    }
+
+    if (update_interest(conn) < 0)
+    {
+        close_conn(conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int register_client(struct conn * conn)
+{
+    if (config.payload_mode == PAYLOAD_ZEROCOPY)
+    {
+        int one = 1;
+        conn->zc_enabled = setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    unsigned int spin_us = __atomic_load_n(&config.spin_us, __ATOMIC_RELAXED);
+    if (spin_us)
+    {
+        set_busy_poll(conn->fd, spin_us);
+    }
+
+    struct epoll_event epoll_temp;
+    epoll_temp.events = EPOLLIN | EPOLLHUP | EPOLLRDHUP | (config.edge ? EPOLLET : 0);
+    epoll_temp.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &epoll_temp) < 0)
+    {
+        perror("epoll_ctl add client < 0\n");
+        return -1;
+    }
+    conn->events = epoll_temp.events;
+    conn_open(conn);
+    return 0;
+}
+
+// out of descriptors the pending client is shed through the reserve fd:
+// left in the backlog it would keep the listener readable forever in level
+// mode, and in edge mode no new edge would ever report the rest. returns 0
+// when one was shed, 1 when the backlog turned out empty and -1 when even
+// the freed descriptor did not help.
+static int shed_client(int listener_fd)
+{
+    close(reserve_fd);
+    int client = accept4(listener_fd, NULL, NULL, SOCK_CLOEXEC);
+    int error = errno;
+    if (client >= 0)
+    {
+        ++stats.accept_shed;
+        close(client);
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (client >= 0)
+    {
+        return 0;
+    }
+    errno = error;
+    return error == EAGAIN || error == EWOULDBLOCK ? 1 : -1;
+}
+
+// in edge mode the backlog is drained until EAGAIN, errors that only concern
+// one pending connection do not stop it
+static void accept_clients(struct conn * listener)
+{
+    do
+    {
+        struct sockaddr_in address;
+        socklen_t size = sizeof(address);
+        int client = accept4(listener->fd, (struct sockaddr *) &address, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && reserve_fd >= 0)
+            {
+                int shed = shed_client(listener->fd);
+                if (shed == 0)
+                {
+                    continue;
+                }
+                if (shed > 0)
+                {
+                    break;
+                }
+            }
+
+            fprintf(stderr, "client fd wrong %d %s\n", client, strerror(errno));
+            break;
+        }
+
+        uint32_t ip = ntohl(address.sin_addr.s_addr);
+        rlog(RL_DEBUG, "new client accepted %lu <%lu.%lu.%lu.%lu:%lu>\n", client, ip >> 24, (ip >> 16) & 0xff,
+             (ip >> 8) & 0xff, ip & 0xff, ntohs(address.sin_port));
+        struct conn * conn = conn_get(&conn_pool);
+        if (conn == NULL)
+        {
+            fprintf(stderr, "no conn for client %d\n", client);
+            close(client);
+            continue;
+        }
+
+        conn->fd = client;
+        conn->addr = address;
+        if (register_client(conn) < 0)
+        {
+            close(client);
+            pool_put(&conn_pool, conn);
+        }
+    }
+    while (config.edge);
+}
+
+// clients that come from the previous process are mid-session, they skip
+// the first-request deadline and get their carried-over output flushed
+static void adopt_clients(void)
+{
+    while (adopted)
+    {
+        struct conn * conn = adopted;
+        adopted = conn->next;
+
+        int fl = fcntl(conn->fd, F_GETFL);
+        fcntl(conn->fd, F_SETFL, fl | O_NONBLOCK);
+        if (register_client(conn) < 0)
+        {
+            close(conn->fd);
+            conn_free_buffers(conn);
+            pool_put(&conn_pool, conn);
+            continue;
+        }
+
+        timer_cancel(&wheel, &conn->header_timer);
+        if (conn->out_head)
+        {
+            flush_conn(conn);
+        }
+    }
+}
+
+// the successor has the listener now, stop accepting and serve the clients
+// that are left until they are gone
+static void hand_off(struct conn * handoff, struct conn * listener)
+{
+    if (handoff_serve(handoff->fd, listener->fd) < 0)
+    {
+        return;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listener->fd, NULL);
+    close(listener->fd);
+    listener->fd = -1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handoff->fd, NULL);
+    close(handoff->fd);
+    handoff->fd = -1;
+    draining = 1;
+}
+
+// level mode does a single recv per wakeup, edge mode keeps reading until the
+// socket reports EAGAIN or the per-wakeup budget is spent. reading stops while
+// the client's output queue is above the high-water mark.
+static void read_conn(struct conn * conn)
+{
+    size_t budget = config.budget;
+
+    while (!conn->paused)
+    {
+        if (conn->rbuf == NULL)
+        {
+            conn->rbuf = buffer_get(&buffer_pool);
+            if (conn->rbuf == NULL)
+            {
+                fprintf(stderr, "no buffer for client %d\n", conn->fd);
+                close_conn(conn);
+                return;
+            }
+        }
+
+        struct buffer * rbuf = conn->rbuf;
+        ssize_t read = recv(conn->fd, rbuf->data + rbuf->len, BUFFER_SIZE - rbuf->len, 0);
+        ++stats.recv_calls;
+        if (read == 0)
+        {
+            close_conn(conn);
+            return;
+        }
+        else if (read < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                fprintf(stderr, "client %d recv %s\n", conn->fd, strerror(errno));
+                close_conn(conn);
+                return;
+            }
+            break;
+        }
+
+        stats.recv_bytes += read;
+        conn->last_active = wheel.now;
+        if (config.framing == FRAME_NONE)
+        {
+            timer_cancel(&wheel, &conn->header_timer);
+        }
+        rbuf->len += read;
+        if (conn_process(conn) < 0)
+        {
+            close_conn(conn);
+            return;
+        }
 
-#include <sys/epoll.h>
+        if (conn->out_bytes >= config.high_water)
+        {
+            if (flush_conn(conn) < 0)
+            {
+                return;
+            }
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+            if (conn->out_bytes >= config.high_water)
+            {
+                ++stats.pauses;
+                conn->paused = 1;
+                break;
+            }
+        }
 
-#include <pthread.h>
+        if (!config.edge)
+        {
+            break;
+        }
 
-#define PORT        9000
-#define BACKLOG     3
-#define POLLSIZE    10
+        if ((size_t) read >= budget)
+        {
+            mark_ready(conn);
+            break;
+        }
 
-pthread_t server;
+        budget -= read;
+    }
+
+    // hand the buffer back as soon as nothing is pending in it,
+    // idle connections then hold no buffer memory at all
+    if (conn->rbuf && conn->rbuf->len == 0)
+    {
+        pool_put(&buffer_pool, conn->rbuf);
+        conn->rbuf = NULL;
+    }
+
+    flush_conn(conn);
+}
+
+static void run_ready(void)
+{
+    struct conn * list = ready_list;
+    ready_list = NULL;
+
+    while (list)
+    {
+        struct conn * conn = list;
+        list = conn->ready_next;
+        conn->ready = 0;
+
+        if (conn->fd >= 0)
+        {
+            read_conn(conn);
+        }
+    }
+}
+
+// epoll_wait itself busy-polls the napi contexts of its sockets, per epoll
+// instance since 6.9
+static void set_epoll_busy_poll(unsigned int usecs)
+{
+    static int unsupported;
+    struct epoll_params params = {0};
+
+    params.busy_poll_usecs = usecs;
+    params.busy_poll_budget = usecs ? 8 : 0;
+    params.prefer_busy_poll = usecs != 0;
+    if (!unsupported && ioctl(epoll_fd, EPIOCSPARAMS, &params) < 0)
+    {
+        unsupported = 1;
+        fprintf(stderr, "epoll busy poll parameters not supported: %s\n", strerror(errno));
+    }
+}
+
+// in busy-poll mode an idle reactor keeps calling epoll_wait without a timeout
+// for spin_us and only then sleeps, so an event arriving within the window is
+// picked up without a wakeup. the spin window restarts after every batch.
+static int wait_events(struct epoll_event * events)
+{
+    static unsigned int applied;
+    unsigned int spin_us = __atomic_load_n(&config.spin_us, __ATOMIC_RELAXED);
+
+    if (spin_us != applied)
+    {
+        applied = spin_us;
+        set_epoll_busy_poll(spin_us);
+    }
+
+    if (ready_list)
+    {
+        return epoll_wait(epoll_fd, events, POLLSIZE, 0);
+    }
+
+    if (spin_us)
+    {
+        uint64_t deadline = now_ns() + spin_us * 1000ULL;
+        do
+        {
+            int epoll_size = epoll_wait(epoll_fd, events, POLLSIZE, 0);
+            ++stats.spin_polls;
+            if (epoll_size != 0)
+            {
+                stats.spin_hits += epoll_size > 0;
+                return epoll_size;
+            }
+        }
+        while (now_ns() < deadline);
+    }
+
+    return epoll_wait(epoll_fd, events, POLLSIZE, -1);
+}
 
 void * thread_server(void * args)
 {
     puts("server started\n");
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    int server_socket = open_listener(SOCK_NONBLOCK);
     if (server_socket < 0)
     {
-        perror("server < 0\n");
         return NULL;
     }
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_port = htons(PORT);
-    address.sin_addr.s_addr = INADDR_ANY;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1 < 0\n");
+        close(server_socket);
+        return NULL;
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    if (bind(server_socket, (struct sockaddr*) &address, sizeof(address)) < 0)
+    struct conn * listener = conn_get(&conn_pool);
+    if (listener == NULL)
     {
-        perror("bind server < 0\n");
+        perror("listener conn < 0\n");
+        close(epoll_fd);
         close(server_socket);
         return NULL;
     }
 
-    if (listen(server_socket, BACKLOG) < 0)
+    listener->fd = server_socket;
+    listener->kind = CONN_LISTENER;
+
+    struct epoll_event epoll_temp, epoll_return_events[POLLSIZE];
+
+    epoll_temp.events = EPOLLIN | (config.edge ? EPOLLET : 0);
+    epoll_temp.data.ptr = listener;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &epoll_temp) < 0)
     {
-        perror("listen < 0\n");
+        perror("epoll_ctl add listen < 0\n");
+        pool_put(&conn_pool, listener);
+        close(epoll_fd);
         close(server_socket);
         return NULL;
     }
 
-    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (epoll_fd < 0)
+    struct conn * ticker = conn_get(&conn_pool);
+    if (ticker == NULL)
     {
-        perror("epoll_create1 < 0\n");
+        perror("ticker conn < 0\n");
+        pool_put(&conn_pool, listener);
+        close(epoll_fd);
         close(server_socket);
         return NULL;
     }
 
-    struct epoll_event epoll_temp, epoll_return_events[POLLSIZE];
+    ticker->kind = CONN_TIMER;
+    ticker->fd = open_ticker(TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ticker->fd < 0)
+    {
+        pool_put(&conn_pool, ticker);
+        pool_put(&conn_pool, listener);
+        close(epoll_fd);
+        close(server_socket);
+        return NULL;
+    }
 
     epoll_temp.events = EPOLLIN;
-    epoll_temp.data.fd = server_socket;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &epoll_temp) < 0)
+    epoll_temp.data.ptr = ticker;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ticker->fd, &epoll_temp) < 0)
     {
-        perror("epoll_ctl add listen < 0\n");
+        perror("epoll_ctl add timer < 0\n");
+        close(ticker->fd);
+        pool_put(&conn_pool, ticker);
+        pool_put(&conn_pool, listener);
         close(epoll_fd);
         close(server_socket);
         return NULL;
     }
 
-    while (1)
+    struct conn * doorbell = conn_get(&conn_pool);
+    if (doorbell)
+    {
+        doorbell->kind = CONN_MAILBOX;
+        doorbell->fd = mailbox.fd;
+        epoll_temp.events = EPOLLIN;
+        epoll_temp.data.ptr = doorbell;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, doorbell->fd, &epoll_temp) < 0)
+        {
+            perror("epoll_ctl add mailbox < 0\n");
+            pool_put(&conn_pool, doorbell);
+            doorbell = NULL;
+        }
+    }
+
+    start_timers();
+
+    struct conn * handoff = NULL;
+    if (config.handoff_path && (handoff = conn_get(&conn_pool)) != NULL)
+    {
+        handoff->kind = CONN_HANDOFF;
+        handoff->fd = handoff_listen(config.handoff_path);
+        epoll_temp.events = EPOLLIN;
+        epoll_temp.data.ptr = handoff;
+        if (handoff->fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff->fd, &epoll_temp) < 0)
+        {
+            fprintf(stderr, "hot restart unavailable on %s\n", config.handoff_path);
+            if (handoff->fd >= 0)
+            {
+                close(handoff->fd);
+            }
+            pool_put(&conn_pool, handoff);
+            handoff = NULL;
+        }
+    }
+
+    adopt_clients();
+
+    while (!draining || stats.clients > 0)
     {
-        int epoll_size = epoll_wait(epoll_fd, epoll_return_events, POLLSIZE, 1000);
+        int epoll_size = wait_events(epoll_return_events);
+        ++stats.wakeups;
         if (epoll_size > 0)
         {
             for (int i = 0; i < epoll_size; ++i)
             {
-                if (epoll_return_events[i].data.fd == server_socket)
+                struct conn * conn = epoll_return_events[i].data.ptr;
+                uint32_t events = epoll_return_events[i].events;
+
+                if (conn->fd < 0)
+                {
+                    continue; // closed earlier in this batch
+                }
+
+                if (conn->kind == CONN_LISTENER)
+                {
+                    accept_clients(conn);
+                }
+                else if (conn->kind == CONN_HANDOFF)
                 {
-                    printf("new client got\n");
-                    socklen_t size = sizeof(address);
-                    int client = accept4(server_socket, (struct sockaddr *) &address, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
-//                    int client = accept(server_socket, (struct sockaddr *) &address, &size);
-                    if (client > 0)
+                    hand_off(conn, listener);
+                }
+                else if (conn->kind == CONN_TIMER)
+                {
+                    uint64_t expirations;
+                    if (read(conn->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
                     {
-                        printf("new client accepted %d <%s:%d>\n", client, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                        epoll_temp.events = EPOLLIN | EPOLLHUP | EPOLLRDHUP; // | EPOLLOUT
-                        epoll_temp.data.fd = client;
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &epoll_temp) < 0)
-                        {
-                            perror("epoll_ctl add client < 0\n");
-                            close(client);
-                            break;
-                        }
+                        timer_wheel_advance(&wheel, expirations);
                     }
-                    else
+                }
+                else if (conn->kind == CONN_MAILBOX)
+                {
+                    uint64_t rings;
+                    if (read(conn->fd, &rings, sizeof(rings)) == sizeof(rings))
                     {
-                        fprintf(stderr, "client fd wrong %d\n", client);
+                        ++stats.mailbox_wakeups;
                     }
+                    reactor_drain();
                 }
                 else
                 {
-                    if (epoll_return_events[i].events & EPOLLIN)
+                    if ((events & EPOLLERR) && conn->zc_enabled)
                     {
-                        char receive_buffer[5];
-                        int read = recv(epoll_return_events[i].data.fd, receive_buffer, sizeof(receive_buffer), 0);
-                        printf("client %d EPOLLIN event read %d\n", epoll_return_events[i].data.fd, read);
-                        if (read == 0)
-                        {
-                            printf("client %d closing\n", epoll_return_events[i].data.fd);
-                            if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, epoll_return_events[i].data.fd, NULL) < 0)
-                            {
-                                perror("epoll_ctl del client < 0\n");
-                                close(epoll_return_events[i].data.fd);
-                                break;
-                            }
-                            close(epoll_return_events[i].data.fd);
-                        }
-                        else if (read > 0)
-                        {
-                            printf("client %d: %*.*s\n", epoll_return_events[i].data.fd, read, read, receive_buffer);
-//                            char send_buffer[] = "hello";
-//                            printf("server send %ld\n", send(epoll_return_events[i].data.fd, send_buffer, sizeof(send_buffer), 0));
-                        }
+                        reap_zerocopy(conn);
                     }
 
-                    if (epoll_return_events[i].events & EPOLLOUT)
+                    if (events & EPOLLIN)
                     {
-                        printf("client %d EPOLLOUT\n", epoll_return_events[i].data.fd);
+                        read_conn(conn);
+                        if (conn->fd < 0)
+                        {
+                            continue;
+                        }
                     }
 
-                    if (epoll_return_events[i].events & EPOLLHUP)
+                    if (events & EPOLLOUT)
                     {
-                        printf("client %d EPOLLHUP\n", epoll_return_events[i].data.fd);
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, epoll_return_events[i].data.fd, NULL) < 0)
+                        if (flush_conn(conn) < 0)
                         {
-                            perror("epoll_ctl del client < 0\n");
-                            close(epoll_return_events[i].data.fd);
-                            break;
+                            continue;
                         }
-                        close(epoll_return_events[i].data.fd);
                     }
 
-                    if (epoll_return_events[i].events & EPOLLRDHUP)
+                    if (events & EPOLLHUP)
                     {
-                        printf("client %d EPOLLRDHUP\n", epoll_return_events[i].data.fd);
+                        rlog(RL_DEBUG, "client %lu EPOLLHUP\n", conn->fd);
+                        close_conn(conn);
+                        continue;
+                    }
+
+                    if (events & EPOLLRDHUP)
+                    {
+                        rlog(RL_DEBUG, "client %lu EPOLLRDHUP\n", conn->fd);
                     }
                 }
             }
         }
-        else if (epoll_size == 0)
-        {
-//            printf("nothing happened\n");
-        }
-        else
+        else if (epoll_size < 0 && errno != EINTR)
         {
             perror("epoll_wait < 0\n");
             break;
         }
+
+        run_ready();
+        release_closed();
     }
 
+    if (handoff)
+    {
+        if (handoff->fd >= 0)
+        {
+            close(handoff->fd);
+            unlink(config.handoff_path);
+        }
+        pool_put(&conn_pool, handoff);
+    }
+    if (doorbell)
+    {
+        pool_put(&conn_pool, doorbell);
+    }
+    close(ticker->fd);
+    pool_put(&conn_pool, ticker);
+    if (listener->fd >= 0)
+    {
+        close(listener->fd);
+    }
+    pool_put(&conn_pool, listener);
     close(epoll_fd);
-    close(server_socket);
     return NULL;
 }
 
-int main(int argc, char * argv[])
+const struct backend epoll_backend =
+{
+    .name = "epoll",
+    .run = thread_server,
+    .close = close_conn,
+    .flush = flush_conn,
+};
+
+static int compare_u64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// one client doing strictly sequential round trips against the echo handler,
+// the reactor mode is switched through config.spin_us between the runs and
+// every run gets a fresh connection so accept applies the socket options too
+static int pingpong_run(const char * name, unsigned int spin_us, uint64_t * samples, unsigned int count)
+{
+    char message[PINGPONG_SIZE] = {0};
+
+    __atomic_store_n(&config.spin_us, spin_us, __ATOMIC_RELAXED);
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < 100; ++attempt)
+    {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+        {
+            close(fd);
+            fd = -1;
+            usleep(10000); // listener not up yet
+        }
+    }
+    if (fd < 0)
+    {
+        perror("pingpong connect < 0\n");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (spin_us)
+    {
+        set_busy_poll(fd, spin_us);
+    }
+
+    for (unsigned int i = 0; i < PINGPONG_WARMUP + count; ++i)
+    {
+        uint64_t start = now_ns();
+        if (send(fd, message, sizeof(message), MSG_NOSIGNAL) != sizeof(message))
+        {
+            perror("pingpong send\n");
+            close(fd);
+            return -1;
+        }
+
+        for (size_t got = 0; got < sizeof(message);)
+        {
+            ssize_t ret = recv(fd, message + got, sizeof(message) - got, 0);
+            if (ret <= 0)
+            {
+                perror("pingpong recv\n");
+                close(fd);
+                return -1;
+            }
+            got += ret;
+        }
+
+        if (i >= PINGPONG_WARMUP)
+        {
+            samples[i - PINGPONG_WARMUP] = now_ns() - start;
+        }
+    }
+    close(fd);
+
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    printf("%-10s %u round trips of %d bytes: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           name, count, PINGPONG_SIZE, samples[count / 2] / 1e3, samples[count * 99 / 100] / 1e3,
+           samples[count * 999 / 1000] / 1e3, samples[count - 1] / 1e3);
+    return 0;
+}
+
+static int pingpong(unsigned int count)
 {
-    pthread_create(&server, NULL, thread_server, NULL);
+    unsigned int spin_us = config.spin_us ? config.spin_us : SPIN_US;
+    uint64_t * samples = malloc(count * sizeof(*samples));
+    if (samples == NULL)
+    {
+        return -1;
+    }
+
+    int ret = pingpong_run("blocking", 0, samples, count);
+    if (ret == 0)
+    {
+        ret = pingpong_run("busy-poll", spin_us, samples, count);
+    }
+
+    free(samples);
+    return ret;
+}
+
+int server_main(int argc, char * argv[], const struct handler * app)
+{
+    int opt;
+    int log_level = RL_INFO;
+
+    config.budget = READ_BUDGET;
+    config.high_water = HIGH_WATER;
+    config.tick_ms = TICK_MS;
+    config.idle_ms = IDLE_MS;
+    config.header_ms = HEADER_MS;
+    config.write_ms = WRITE_MS;
+    application = app ? app : &echo_handler;
+
+    while ((opt = getopt_long(argc, argv, "ueb:w:i:r:o:k:f:m:F:s:P:H:CUt:gGW:l:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                backend = &uring_backend;
+                break;
+            case 'e':
+                config.edge = 1;
+                break;
+            case 'b':
+                config.budget = (size_t) atol(optarg);
+                break;
+            case 'w':
+                config.high_water = (size_t) atol(optarg);
+                break;
+            case 'i':
+                config.idle_ms = (unsigned int) atoi(optarg);
+                break;
+            case 'r':
+                config.header_ms = (unsigned int) atoi(optarg);
+                break;
+            case 'o':
+                config.write_ms = (unsigned int) atoi(optarg);
+                break;
+            case 'k':
+                config.tick_ms = (unsigned int) atoi(optarg);
+                break;
+            case 'f':
+                config.payload_path = optarg;
+                break;
+            case 'm':
+                if (strcmp(optarg, "copy") == 0)
+                {
+                    config.payload_mode = PAYLOAD_COPY;
+                }
+                else if (strcmp(optarg, "sendfile") == 0)
+                {
+                    config.payload_mode = PAYLOAD_SENDFILE;
+                }
+                else if (strcmp(optarg, "zerocopy") == 0)
+                {
+                    config.payload_mode = PAYLOAD_ZEROCOPY;
+                }
+                else
+                {
+                    print_help();
+                    return -1;
+                }
+                break;
+            case 's':
+                config.spin_us = (unsigned int) atoi(optarg);
+                break;
+            case 'P':
+                config.pingpong = (unsigned int) atoi(optarg);
+                break;
+            case 'U':
+                config.udp = 1;
+                break;
+            case 't':
+                config.threads = (unsigned int) atoi(optarg);
+                break;
+            case 'g':
+                config.udp_gro = 1;
+                break;
+            case 'G':
+                config.udp_gso = 1;
+                break;
+            case 'W':
+                config.workers = (unsigned int) atoi(optarg);
+                break;
+            case 'l':
+                log_level = ringlog_parse_level(optarg);
+                if (log_level < 0)
+                {
+                    print_help();
+                    return -1;
+                }
+                break;
+            case 'H':
+                config.handoff_path = optarg;
+                break;
+            case 'C':
+                config.handoff_clients = 1;
+                break;
+            case 'F':
+                if (strcmp(optarg, "fixed") == 0)
+                {
+                    config.framing = FRAME_FIXED;
+                }
+                else if (strcmp(optarg, "varint") == 0)
+                {
+                    config.framing = FRAME_VARINT;
+                }
+                else
+                {
+                    print_help();
+                    return -1;
+                }
+                break;
+            default:
+                print_help();
+                return -1;
+        }
+    }
+
+    if (config.budget == 0 || config.high_water == 0 || config.tick_ms == 0)
+    {
+        fprintf(stderr, "budget, high-water and tick must be positive.\n");
+        return -1;
+    }
+
+    // everything that only depends on the options is checked before the
+    // logger starts, failures past that point go through fail to stop it
+    if (backend == &uring_backend && config.payload_mode != PAYLOAD_COPY)
+    {
+        fprintf(stderr, "sendfile and zerocopy payloads need the epoll backend.\n");
+        return -1;
+    }
+
+    if (backend == &uring_backend && (config.spin_us || config.pingpong))
+    {
+        fprintf(stderr, "busy-poll needs the epoll backend.\n");
+        return -1;
+    }
+
+    if (backend == &uring_backend && config.handoff_path)
+    {
+        fprintf(stderr, "hot restart needs the epoll backend.\n");
+        return -1;
+    }
+
+    if (config.pingpong && (config.payload_path || config.framing != FRAME_NONE))
+    {
+        fprintf(stderr, "the ping-pong benchmark runs against the plain echo handler.\n");
+        return -1;
+    }
+
+    if (ringlog_start(STDOUT_FILENO, log_level, 100) < 0)
+    {
+        return -1;
+    }
+
+    if (config.udp)
+    {
+        int ret = udp_run();
+        ringlog_stop();
+        return ret < 0 ? -1 : 0;
+    }
+
+    if (mailbox_init(&mailbox) < 0)
+    {
+        perror("mailbox eventfd < 0\n");
+        goto fail;
+    }
+
+    if (config.workers)
+    {
+        if (workers_start(config.workers) < 0)
+        {
+            goto fail;
+        }
+        application = &worker_handler;
+    }
+
+    if (config.payload_path)
+    {
+        if (load_payload(config.payload_path) < 0)
+        {
+            goto fail;
+        }
+        application = &payload_handler;
+    }
+    if (config.framing != FRAME_NONE && application->on_frame == NULL)
+    {
+        fprintf(stderr, "the handler does not take frames.\n");
+        goto fail;
+    }
+    handler = config.framing == FRAME_NONE ? application : &frame_handler;
+
+    if (pool_init(&conn_pool, sizeof(struct conn), CONN_SLAB_COUNT, CONN_SLAB_COUNT) < 0 ||
+        pool_init(&buffer_pool, sizeof(struct buffer), BUFFER_SLAB_COUNT, BUFFER_SLAB_COUNT) < 0 ||
+        pool_init(&segment_pool, sizeof(struct segment), SEGMENT_SLAB_COUNT, SEGMENT_SLAB_COUNT) < 0)
+    {
+        perror("pool init < 0\n");
+        goto fail;
+    }
+
+    if (config.handoff_path)
+    {
+        inherited_listener = handoff_takeover(config.handoff_path, config.handoff_clients, &adopted);
+    }
+
+    pthread_create(&server, NULL, backend->run, NULL);
+    if (config.pingpong)
+    {
+        // the server thread never exits and still uses the pools, so only
+        // what it logged is written out before the process goes
+        int ret = pingpong(config.pingpong);
+        ringlog_stop();
+        return ret < 0 ? -1 : 0;
+    }
     pthread_join(server, NULL);
+
+    pool_destroy(&segment_pool);
+    pool_destroy(&buffer_pool);
+    pool_destroy(&conn_pool);
+    unload_payload();
+    ringlog_stop();
     return 0;
+
+fail:
+    pool_destroy(&segment_pool);
+    pool_destroy(&buffer_pool);
+    pool_destroy(&conn_pool);
+    unload_payload();
+    ringlog_stop();
+    return -1;
 }
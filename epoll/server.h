@@ -0,0 +1,167 @@
+#ifndef EPOLL_SERVER_H
+#define EPOLL_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "conn.h"
+#include "frame.h"
+#include "mailbox.h"
+#include "timer-wheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PORT            9000
+#define BACKLOG         SOMAXCONN
+
+enum payload_mode
+{
+    PAYLOAD_COPY,               // send() from the mapped blob, the kernel copies it into socket buffers
+    PAYLOAD_SENDFILE,           // sendfile() straight from the page cache
+    PAYLOAD_ZEROCOPY,           // sendmsg(MSG_ZEROCOPY) pinning the mapped pages
+};
+
+struct server_config
+{
+    int edge;
+    size_t budget;
+    size_t high_water;
+    unsigned int tick_ms;
+    unsigned int idle_ms;
+    unsigned int header_ms;
+    unsigned int write_ms;
+    const char * payload_path;  // answer every request line with this file instead of echoing
+    enum payload_mode payload_mode;
+    enum frame_prefix framing;  // split input into length-prefixed frames for on_frame
+    unsigned int spin_us;       // busy-poll: spin on epoll_wait(0) this long before blocking, 0 blocks at once
+    unsigned int pingpong;      // run the loopback latency benchmark with this many round trips
+    const char * handoff_path;  // unix socket for hot restarts, taken over from a running server first
+    int handoff_clients;        // ask the running server for its clients too, not just the listener
+    int udp;                    // echo datagrams on per-core SO_REUSEPORT sockets instead of serving tcp
+    unsigned int threads;       // udp workers, 0 runs one per online cpu
+    unsigned int workers;       // threads answering tcp requests through the reactor mailbox
+    int udp_gro;                // receive coalesced datagram trains with UDP_GRO
+    int udp_gso;                // send them back whole with UDP_SEGMENT
+};
+
+struct server_stats
+{
+    unsigned long wakeups;      // epoll_wait or io_uring_enter calls
+    unsigned long recv_calls;   // recv syscalls or recv completions
+    unsigned long recv_bytes;
+    unsigned long accepts;
+    unsigned long accept_shed;  // pending clients closed unserved while out of descriptors
+    unsigned long send_calls;   // sendmsg syscalls or send completions
+    unsigned long send_bytes;
+    unsigned long pauses;
+    unsigned long timeouts;
+    unsigned long clients;
+    unsigned long sendfile_calls;
+    unsigned long zc_sends;
+    unsigned long zc_completions;
+    unsigned long zc_copied;    // completions where the kernel fell back to copying
+    unsigned long zc_nobufs;    // zerocopy runs sent as plain copies after ENOBUFS
+    unsigned long frames;
+    unsigned long frame_passes; // on_data calls that delivered at least one frame
+    unsigned long spin_polls;   // zero timeout epoll_wait calls made while spinning
+    unsigned long spin_hits;    // spins that found events before falling back to blocking
+    unsigned long handoffs;     // clients handed to a successor or adopted from a predecessor
+    unsigned long handoff_failures; // clients a predecessor sent that could not be adopted and were closed
+    unsigned long mailbox_wakeups;
+    unsigned long posts;        // cross-thread posts run by the reactor
+    unsigned long stale_posts;  // responses for clients that were gone by then
+};
+
+// application callbacks, the same for every backend
+struct handler
+{
+    void (*on_open)(struct conn * conn);
+    // bytes of data consumed, the rest is kept in conn->rbuf and offered again
+    // with more bytes appended after the next read. -1 closes the connection.
+    ssize_t (*on_data)(struct conn * conn, const char * data, size_t len);
+    // one complete frame body when framing is on, still inside the read buffer
+    // and only valid for the duration of the call. -1 closes the connection.
+    int (*on_frame)(struct conn * conn, const char * data, size_t len);
+    // queued output fell below half the high-water mark. runs in the middle of
+    // a flush, so it may queue more output but must not flush or close.
+    void (*on_drain)(struct conn * conn);
+    void (*on_close)(struct conn * conn);
+};
+
+// a client as other threads refer to it. only the reactor may resolve it,
+// after the client closed it resolves to NULL even when the memory was reused.
+struct conn_ref
+{
+    struct conn * conn;
+    uint32_t generation;
+};
+
+// event loop implementation the shared connection code calls back into
+struct backend
+{
+    const char * name;
+    void * (*run)(void * args);
+    void (*close)(struct conn * conn);
+    int (*flush)(struct conn * conn);
+};
+
+extern struct server_config config;
+extern struct server_stats stats;
+extern struct pool conn_pool;
+extern struct pool buffer_pool;
+extern struct pool segment_pool;
+extern struct timer_wheel wheel;
+extern const struct handler * handler;
+extern const struct handler * application;
+extern const struct backend * backend;
+extern const struct backend epoll_backend;
+extern const struct backend uring_backend;
+extern struct conn * live_conns;
+extern struct mailbox mailbox;
+
+uint64_t ms_to_ticks(unsigned int ms);
+int open_listener(int flags);
+int open_ticker(int flags);
+void start_timers(void);
+
+void conn_open(struct conn * conn);
+void conn_closed(struct conn * conn);
+void conn_free_buffers(struct conn * conn);
+int conn_process(struct conn * conn);
+int conn_receive(struct conn * conn, const char * data, size_t len);
+int conn_send(struct conn * conn, const void * data, size_t len);
+int conn_send_ref(struct conn * conn, const void * data, size_t len, int zerocopy);
+int conn_send_file(struct conn * conn, int fd, off_t offset, size_t len);
+void conn_consume_output(struct conn * conn, size_t sent);
+
+struct conn_ref conn_ref_get(struct conn * conn);
+struct conn * conn_ref_resolve(struct conn_ref ref);
+// any thread: run post->fn on the reactor thread
+void reactor_post(struct post * post);
+// any thread: queue a copy of data as output for ref, dropped if it closed
+int reactor_send(struct conn_ref ref, const void * data, size_t len);
+// reactor thread: run everything posted so far, then flush posted output
+void reactor_drain(void);
+
+int handoff_listen(const char * path);
+// blocks the calling reactor until the successor has everything, see handoff.c
+int handoff_serve(int unix_listener, int listener);
+int handoff_takeover(const char * path, int want_clients, struct conn ** adopted);
+
+int udp_run(void);
+
+extern const struct handler worker_handler;
+int workers_start(unsigned int count);
+
+// parse the command line and run the server with app as the application
+// handler, NULL serves the built-in echo
+int server_main(int argc, char * argv[], const struct handler * app);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EPOLL_SERVER_H
@@ -0,0 +1,134 @@
+#include <string.h>
+
+#include "timer-wheel.h"
+
+#define TW_MASK         (TW_SLOTS - 1)
+
+static void link_timer(struct timer ** head, struct timer * timer)
+{
+    timer->next = *head;
+    if (timer->next)
+    {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+}
+
+static void unlink_timer(struct timer * timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// pick the lowest level whose range still covers the deadline, the slot is
+// indexed by the deadline's bits for that level
+static void place_timer(struct timer_wheel * wheel, struct timer * timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < TW_LEVELS - 1 && delta >= (1ULL << (TW_BITS * (level + 1))))
+    {
+        ++level;
+    }
+
+    link_timer(&wheel->slots[level][(timer->expires >> (TW_BITS * level)) & TW_MASK], timer);
+}
+
+void timer_wheel_init(struct timer_wheel * wheel, void * data)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->data = data;
+}
+
+void timer_init(struct timer * timer, void (*fn)(struct timer_wheel * wheel, struct timer * timer))
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+}
+
+void timer_arm(struct timer_wheel * wheel, struct timer * timer, uint64_t ticks)
+{
+    if (timer_armed(timer))
+    {
+        unlink_timer(timer);
+    }
+    else
+    {
+        ++wheel->count;
+    }
+
+    timer->expires = wheel->now + (ticks > TW_MAX_TICKS ? TW_MAX_TICKS : ticks);
+    place_timer(wheel, timer);
+}
+
+void timer_cancel(struct timer_wheel * wheel, struct timer * timer)
+{
+    if (timer_armed(timer))
+    {
+        unlink_timer(timer);
+        --wheel->count;
+    }
+}
+
+// move every timer of one upper-level slot down to where it belongs now
+static int cascade(struct timer_wheel * wheel, int level)
+{
+    int index = (wheel->now >> (TW_BITS * level)) & TW_MASK;
+    struct timer * list = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+
+    while (list)
+    {
+        struct timer * timer = list;
+        list = timer->next;
+        place_timer(wheel, timer);
+    }
+
+    return index;
+}
+
+void timer_wheel_advance(struct timer_wheel * wheel, uint64_t ticks)
+{
+    while (ticks--)
+    {
+        int index = wheel->now & TW_MASK;
+        for (int level = 1; index == 0 && level < TW_LEVELS; ++level)
+        {
+            index = cascade(wheel, level);
+        }
+
+        struct timer * expired = wheel->slots[0][wheel->now & TW_MASK];
+        wheel->slots[0][wheel->now & TW_MASK] = NULL;
+        ++wheel->now;
+
+        // callbacks may arm or cancel anything, including timers still on
+        // this list, so the list gets a head of its own before running them
+        if (expired)
+        {
+            expired->pprev = &expired;
+        }
+
+        while (expired)
+        {
+            struct timer * timer = expired;
+            unlink_timer(timer);
+            --wheel->count;
+            timer->fn(wheel, timer);
+        }
+
+        if (wheel->count == 0)
+        {
+            wheel->now += ticks; // nothing armed, skip the remaining ticks at once
+            break;
+        }
+    }
+}
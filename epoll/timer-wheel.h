@@ -0,0 +1,53 @@
+#ifndef EPOLL_TIMER_WHEEL_H
+#define EPOLL_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TW_BITS         6
+#define TW_SLOTS        (1 << TW_BITS)
+#define TW_LEVELS       4
+#define TW_MAX_TICKS    ((1ULL << (TW_BITS * TW_LEVELS)) - 1)   // longer timeouts are clamped
+
+struct timer_wheel;
+
+// intrusive timer, embed it in the object that owns the deadline
+struct timer
+{
+    struct timer * next;
+    struct timer ** pprev;      // NULL while not armed
+    uint64_t expires;           // absolute tick
+    void (*fn)(struct timer_wheel * wheel, struct timer * timer);
+};
+
+// hierarchical hashed timing wheel: level 0 has one slot per tick, every level
+// above covers TW_SLOTS times the range of the one below and is cascaded down
+// as time reaches it. arm and cancel are O(1).
+struct timer_wheel
+{
+    uint64_t now;               // next tick to be processed
+    size_t count;               // armed timers
+    void * data;                // owner context for the callbacks
+    struct timer * slots[TW_LEVELS][TW_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel * wheel, void * data);
+void timer_init(struct timer * timer, void (*fn)(struct timer_wheel * wheel, struct timer * timer));
+void timer_arm(struct timer_wheel * wheel, struct timer * timer, uint64_t ticks);
+void timer_cancel(struct timer_wheel * wheel, struct timer * timer);
+void timer_wheel_advance(struct timer_wheel * wheel, uint64_t ticks);
+
+static inline int timer_armed(const struct timer * timer)
+{
+    return timer->pprev != NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EPOLL_TIMER_WHEEL_H
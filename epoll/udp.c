@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+
+#include "server.h"
+
+#define UDP_BATCH               64              // datagrams per recvmmsg
+#define UDP_TX_MAX              1024            // replies per sendmmsg, GRO buffers split without GSO
+#define UDP_DATAGRAM_SIZE       2048            // one MTU sized datagram per buffer, longer ones are dropped
+#define UDP_GRO_SIZE            (64 * 1024)     // a GRO buffer holds a whole coalesced train
+#define UDP_RCVBUF              (4 * 1024 * 1024)
+#define UDP_STATS_MS            1000
+
+// one per core: its own SO_REUSEPORT socket, thread and pre-registered
+// buffers. the message headers point at the buffers once and only the
+// lengths are reset per call.
+struct udp_worker
+{
+    int index;
+    int fd;
+    pthread_t thread;
+    size_t buffer_size;
+    char * buffers;
+    struct mmsghdr rx[UDP_BATCH];
+    struct iovec rx_iov[UDP_BATCH];
+    struct sockaddr_in rx_addr[UDP_BATCH];
+    char rx_control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    struct mmsghdr tx[UDP_TX_MAX];
+    struct iovec tx_iov[UDP_TX_MAX];
+    char tx_control[UDP_TX_MAX][CMSG_SPACE(sizeof(uint16_t))];
+    unsigned int tx_segments[UDP_TX_MAX];      // datagrams each reply carries, more than one with GSO
+    unsigned int tx_count;
+    // written by the worker once per batch, read by the reporter
+    unsigned long rx_packets;
+    unsigned long rx_bytes;
+    unsigned long tx_packets;
+    unsigned long truncated;
+    unsigned long recv_calls;
+    unsigned long send_calls;
+};
+
+static void add(unsigned long * counter, unsigned long value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static unsigned long load(unsigned long * counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int open_udp(void)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("udp socket < 0\n");
+        return -1;
+    }
+
+    int one = 1, rcvbuf = UDP_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        perror("setsockopt reuse port < 0\n");
+        close(fd);
+        return -1;
+    }
+
+    if (config.udp_gro && setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+    {
+        perror("setsockopt udp gro < 0\n");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT);
+    address.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+    {
+        perror("bind udp < 0\n");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// steer every datagram to the socket with the index of the cpu that received
+// it, so the worker pinned there handles it without crossing cores
+static void steer_by_cpu(int fd)
+{
+    struct sock_filter code[] =
+    {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
+    {
+        perror("setsockopt reuseport cbpf < 0\n");
+    }
+}
+
+static size_t gro_size(struct msghdr * msg, size_t len)
+{
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+
+    return len;
+}
+
+// only what sendmmsg took counts as sent
+static void flush_replies(struct udp_worker * worker)
+{
+    unsigned int done = 0;
+    unsigned long packets = 0;
+
+    while (done < worker->tx_count)
+    {
+        int sent = sendmmsg(worker->fd, worker->tx + done, worker->tx_count - done, 0);
+        add(&worker->send_calls, 1);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // datagrams may be dropped, the rest of the batch goes with them
+            perror("sendmmsg < 0\n");
+            break;
+        }
+        for (int i = 0; i < sent; ++i)
+        {
+            packets += worker->tx_segments[done + i];
+        }
+        done += sent;
+    }
+
+    add(&worker->tx_packets, packets);
+    worker->tx_count = 0;
+}
+
+static void queue_reply(struct udp_worker * worker, struct sockaddr_in * addr, char * data, size_t len, size_t gso,
+                        unsigned int segments)
+{
+    if (worker->tx_count == UDP_TX_MAX)
+    {
+        flush_replies(worker);
+    }
+
+    unsigned int i = worker->tx_count++;
+    struct msghdr * msg = &worker->tx[i].msg_hdr;
+
+    worker->tx_iov[i].iov_base = data;
+    worker->tx_iov[i].iov_len = len;
+    worker->tx_segments[i] = segments;
+    msg->msg_name = addr;
+    msg->msg_namelen = sizeof(*addr);
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+
+    if (gso)
+    {
+        uint16_t size = gso;
+        msg->msg_control = worker->tx_control[i];
+        msg->msg_controllen = sizeof(worker->tx_control[i]);
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+        memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+    }
+}
+
+// echo every datagram back to its sender. a GRO buffer goes back whole with
+// UDP_SEGMENT when GSO is on, otherwise it is split into one reply per
+// original datagram.
+static void * thread_udp(void * args)
+{
+    struct udp_worker * worker = args;
+
+    while (1)
+    {
+        for (int i = 0; i < UDP_BATCH; ++i)
+        {
+            worker->rx[i].msg_hdr.msg_namelen = sizeof(worker->rx_addr[i]);
+            worker->rx[i].msg_hdr.msg_controllen = config.udp_gro ? sizeof(worker->rx_control[i]) : 0;
+        }
+
+        int count = recvmmsg(worker->fd, worker->rx, UDP_BATCH, MSG_WAITFORONE, NULL);
+        add(&worker->recv_calls, 1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("recvmmsg < 0\n");
+            break;
+        }
+
+        unsigned long packets = 0, bytes = 0, truncated = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            // longer than the buffer, echoing the cut off front would be wrong
+            if (worker->rx[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                ++truncated;
+                continue;
+            }
+
+            char * data = worker->rx_iov[i].iov_base;
+            size_t len = worker->rx[i].msg_len;
+            size_t segment = config.udp_gro ? gro_size(&worker->rx[i].msg_hdr, len) : len;
+
+            bytes += len;
+            if (config.udp_gso && segment < len)
+            {
+                unsigned int segments = (len + segment - 1) / segment;
+                packets += segments;
+                queue_reply(worker, &worker->rx_addr[i], data, len, segment, segments);
+                continue;
+            }
+
+            size_t offset = 0;
+            do
+            {
+                size_t chunk = len - offset < segment ? len - offset : segment;
+                queue_reply(worker, &worker->rx_addr[i], data + offset, chunk, 0, 1);
+                offset += chunk;
+                ++packets;
+            }
+            while (offset < len);
+        }
+
+        flush_replies(worker);
+        add(&worker->rx_packets, packets);
+        add(&worker->rx_bytes, bytes);
+        add(&worker->truncated, truncated);
+    }
+
+    return NULL;
+}
+
+static void stop_worker(struct udp_worker * worker)
+{
+    if (worker->fd >= 0)
+    {
+        close(worker->fd);
+    }
+    free(worker->buffers);
+}
+
+static int start_worker(struct udp_worker * worker, int index)
+{
+    worker->index = index;
+    worker->buffer_size = config.udp_gro ? UDP_GRO_SIZE : UDP_DATAGRAM_SIZE;
+    worker->buffers = malloc(UDP_BATCH * worker->buffer_size);
+    worker->fd = open_udp();
+    if (worker->buffers == NULL || worker->fd < 0)
+    {
+        stop_worker(worker);
+        return -1;
+    }
+
+    for (int i = 0; i < UDP_BATCH; ++i)
+    {
+        worker->rx_iov[i].iov_base = worker->buffers + i * worker->buffer_size;
+        worker->rx_iov[i].iov_len = worker->buffer_size;
+        worker->rx[i].msg_hdr.msg_iov = &worker->rx_iov[i];
+        worker->rx[i].msg_hdr.msg_iovlen = 1;
+        worker->rx[i].msg_hdr.msg_name = &worker->rx_addr[i];
+        worker->rx[i].msg_hdr.msg_control = worker->rx_control[i];
+    }
+    for (int i = 0; i < UDP_TX_MAX; ++i)
+    {
+        worker->tx[i].msg_hdr.msg_iov = &worker->tx_iov[i];
+        worker->tx[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+// one socket per worker in cpu order, the steering program on the group, then
+// the workers pinned one per cpu we may run on. the calling thread reports
+// until killed.
+int udp_run(void)
+{
+    // the cpus in our affinity mask, which need not start at 0 or be contiguous
+    cpu_set_t allowed;
+    int cpu_ids[CPU_SETSIZE];
+    unsigned int cpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        perror("sched_getaffinity < 0\n");
+        return -1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            cpu_ids[cpus++] = cpu;
+        }
+    }
+
+    unsigned int threads = config.threads ? config.threads : cpus;
+    struct udp_worker * workers = calloc(threads, sizeof(*workers));
+    if (workers == NULL)
+    {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < threads; ++i)
+    {
+        if (start_worker(&workers[i], i) < 0)
+        {
+            while (i--)
+            {
+                stop_worker(&workers[i]);
+            }
+            free(workers);
+            return -1;
+        }
+    }
+
+    // the program picks the socket by the receiving cpu's number, which only
+    // lines up with the workers when they sit on cpus 0 up to threads - 1
+    if (threads == cpus && threads > 1 && cpu_ids[cpus - 1] == (int) cpus - 1)
+    {
+        steer_by_cpu(workers[0].fd);
+    }
+
+    for (unsigned int i = 0; i < threads; ++i)
+    {
+        pthread_create(&workers[i].thread, NULL, thread_udp, &workers[i]);
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu_ids[i % cpus], &set);
+        pthread_setaffinity_np(workers[i].thread, sizeof(set), &set);
+    }
+
+    printf("udp: %u sockets on port %d, gro %s, gso %s\n", threads, PORT,
+           config.udp_gro ? "on" : "off", config.udp_gso ? "on" : "off");
+
+    unsigned long last_rx = 0, last_tx = 0, last_bytes = 0, last_truncated = 0, last_recv_calls = 0, last_send_calls = 0;
+    while (1)
+    {
+        usleep(UDP_STATS_MS * 1000);
+
+        unsigned long rx = 0, tx = 0, bytes = 0, truncated = 0, recv_calls = 0, send_calls = 0;
+        for (unsigned int i = 0; i < threads; ++i)
+        {
+            rx += load(&workers[i].rx_packets);
+            tx += load(&workers[i].tx_packets);
+            bytes += load(&workers[i].rx_bytes);
+            truncated += load(&workers[i].truncated);
+            recv_calls += load(&workers[i].recv_calls);
+            send_calls += load(&workers[i].send_calls);
+        }
+
+        if (rx != last_rx)
+        {
+            double seconds = UDP_STATS_MS / 1000.0;
+            printf("udp: rx %.0f pkt/s (%.1f MB/s), tx %.0f pkt/s, recv calls/pkt %.3f, send calls/pkt %.3f\n",
+                   (rx - last_rx) / seconds, (bytes - last_bytes) / seconds / 1e6, (tx - last_tx) / seconds,
+                   (double) (recv_calls - last_recv_calls) / (rx - last_rx),
+                   tx != last_tx ? (double) (send_calls - last_send_calls) / (tx - last_tx) : 0.0);
+        }
+        if (truncated != last_truncated)
+        {
+            printf("udp: %lu datagrams over %zu bytes dropped\n", truncated - last_truncated,
+                   config.udp_gro ? (size_t) UDP_GRO_SIZE : (size_t) UDP_DATAGRAM_SIZE);
+        }
+        last_rx = rx;
+        last_truncated = truncated;
+        last_tx = tx;
+        last_bytes = bytes;
+        last_recv_calls = recv_calls;
+        last_send_calls = send_calls;
+    }
+
+    return 0;
+}
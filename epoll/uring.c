@@ -0,0 +1,823 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#include <linux/io_uring.h>
+
+#include "conn.h"
+#include "server.h"
+#include "ringlog.h"
+
+#define URING_ENTRIES       4096
+#define URING_BUF_COUNT     1024            // provided buffers, power of two
+#define URING_BUF_SIZE      (16 * 1024)
+#define URING_BGID          0
+#define URING_SEND_CHAIN    64              // segments linked into one send chain
+
+// the operation travels in the low bits of user_data next to the conn pointer
+enum uring_op
+{
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_TICK,
+    OP_CANCEL,
+    OP_MAILBOX,
+};
+
+#define OP_MASK             7ULL
+
+static struct
+{
+    int fd;
+    unsigned int * sq_head;
+    unsigned int * sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;     // filled but not yet published sqes end here
+    unsigned int to_submit;
+    unsigned int * cq_head;
+    unsigned int * cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void * sq_ptr;
+    size_t sq_size;
+    void * cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring * buf_ring;
+    char * bufs;
+    unsigned short buf_tail;
+
+    struct conn * listener;
+    struct conn * ticker;
+    uint64_t expirations;
+    uint64_t doorbell;
+
+    // connections whose multishot recv ran out of provided buffers, armed
+    // again once a buffer came back or on the next tick, not every pass
+    struct conn * rearm_list;
+    int rearm_due;
+
+    // completions moved out of the cq while waiting for a free sqe, they
+    // are handled before anything still in the cq
+    struct io_uring_cqe * parked;
+    unsigned int parked_size;
+    unsigned int parked_count;
+    unsigned int parked_next;
+} ring;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params * params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void * arg, unsigned int nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t pack(struct conn * conn, enum uring_op op)
+{
+    return (uint64_t) (uintptr_t) conn | op;
+}
+
+static int uring_setup(void)
+{
+    struct io_uring_params params;
+
+    // cooperative task running and a single issuer avoid IPIs and locking,
+    // older kernels reject the flags so fall back to a plain ring
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER |
+                   IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring.fd < 0 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring.fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring.fd < 0)
+    {
+        perror("io_uring_setup < 0\n");
+        return -1;
+    }
+
+    ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_size > ring.sq_size)
+        {
+            ring.sq_size = ring.cq_size;
+        }
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+    {
+        perror("mmap sq ring\n");
+        close(ring.fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring.cq_ptr = ring.sq_ptr;
+    }
+    else
+    {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED)
+        {
+            perror("mmap cq ring\n");
+            munmap(ring.sq_ptr, ring.sq_size);
+            close(ring.fd);
+            return -1;
+        }
+    }
+
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+    {
+        perror("mmap sqes\n");
+        if (ring.cq_ptr != ring.sq_ptr)
+        {
+            munmap(ring.cq_ptr, ring.cq_size);
+        }
+        munmap(ring.sq_ptr, ring.sq_size);
+        close(ring.fd);
+        return -1;
+    }
+
+    char * sq = ring.sq_ptr;
+    char * cq = ring.cq_ptr;
+    ring.sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring.sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring.sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+    ring.sq_entries = params.sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring.cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring.cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // sqes are always used in ring order, so the indirection array is the identity
+    unsigned int * array = (unsigned int *) (sq + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; ++i)
+    {
+        array[i] = i;
+    }
+
+    return 0;
+}
+
+static void uring_teardown(void)
+{
+    free(ring.parked);
+    ring.parked = NULL;
+    ring.parked_size = 0;
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr != ring.sq_ptr)
+    {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    munmap(ring.sq_ptr, ring.sq_size);
+    close(ring.fd);
+}
+
+// returns 1 when the kernel wants completions reaped before it takes more
+static int uring_submit(unsigned int wait)
+{
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+    while (1)
+    {
+        ++stats.wakeups;
+        int ret = sys_io_uring_enter(ring.fd, ring.to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (ret >= 0)
+        {
+            ring.to_submit -= (unsigned int) ret < ring.to_submit ? (unsigned int) ret : ring.to_submit;
+            return 0;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY)
+        {
+            return 1;
+        }
+
+        perror("io_uring_enter < 0\n");
+        return -1;
+    }
+}
+
+// copy what is in the cq aside and release the slots, without handling
+// anything: this runs from inside the handlers. returns how many were moved.
+static unsigned int park_completions(void)
+{
+    unsigned int head = *ring.cq_head;
+    unsigned int count = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - head;
+    if (ring.parked_count + count > ring.parked_size)
+    {
+        unsigned int size = ring.parked_size ? ring.parked_size : 256;
+        while (size < ring.parked_count + count)
+        {
+            size *= 2;
+        }
+
+        struct io_uring_cqe * parked = realloc(ring.parked, size * sizeof(*parked));
+        if (parked == NULL)
+        {
+            return 0;
+        }
+        ring.parked = parked;
+        ring.parked_size = size;
+    }
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        ring.parked[ring.parked_count++] = ring.cqes[(head + i) & ring.cq_mask];
+    }
+    __atomic_store_n(ring.cq_head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+// sqes are only filled here and published in one go by the next enter,
+// so everything queued while handling a batch of completions costs one syscall.
+// a full sq the kernel refuses to take is waited out by parking completions,
+// or by waiting for one when there is nothing to park.
+static struct io_uring_sqe * get_sqe(void)
+{
+    while (ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+    {
+        int ret = uring_submit(0);
+        if (ret < 0)
+        {
+            return NULL;
+        }
+        if (ret > 0 && park_completions() == 0 &&
+            sys_io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            perror("io_uring_enter < 0\n");
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe * sqe = &ring.sqes[ring.sq_local_tail & ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring.sq_local_tail;
+    ++ring.to_submit;
+    return sqe;
+}
+
+static void recycle_buffer(unsigned short bid)
+{
+    struct io_uring_buf * buf = &ring.buf_ring->bufs[ring.buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (ring.bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ++ring.buf_tail;
+    __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+    ring.rearm_due = 1;
+}
+
+static int setup_buffers(void)
+{
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring.buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buf_ring == MAP_FAILED)
+    {
+        perror("mmap buffer ring\n");
+        return -1;
+    }
+
+    ring.bufs = mmap(NULL, (size_t) URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.bufs == MAP_FAILED)
+    {
+        perror("mmap buffers\n");
+        munmap(ring.buf_ring, ring_size);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring.buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        perror("io_uring_register pbuf ring < 0\n");
+        munmap(ring.bufs, (size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+        munmap(ring.buf_ring, ring_size);
+        return -1;
+    }
+
+    ring.buf_tail = 0;
+    for (unsigned short bid = 0; bid < URING_BUF_COUNT; ++bid)
+    {
+        recycle_buffer(bid);
+    }
+
+    return 0;
+}
+
+static void teardown_buffers(void)
+{
+    munmap(ring.bufs, (size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+    munmap(ring.buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+}
+
+static int arm_accept(void)
+{
+    struct io_uring_sqe * sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring.listener->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = pack(ring.listener, OP_ACCEPT);
+    return 0;
+}
+
+static int arm_tick(void)
+{
+    struct io_uring_sqe * sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring.ticker->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &ring.expirations;
+    sqe->len = sizeof(ring.expirations);
+    sqe->user_data = pack(ring.ticker, OP_TICK);
+    return 0;
+}
+
+static int arm_mailbox(void)
+{
+    struct io_uring_sqe * sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = mailbox.fd;
+    sqe->addr = (uint64_t) (uintptr_t) &ring.doorbell;
+    sqe->len = sizeof(ring.doorbell);
+    sqe->user_data = OP_MAILBOX;
+    return 0;
+}
+
+static int arm_recv(struct conn * conn)
+{
+    struct io_uring_sqe * sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = pack(conn, OP_RECV);
+    conn->reading = 1;
+    ++conn->ops;
+    return 0;
+}
+
+static void cancel_recv(struct conn * conn)
+{
+    struct io_uring_sqe * sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = pack(conn, OP_RECV);
+    sqe->user_data = pack(conn, OP_CANCEL);
+    ++conn->ops;
+}
+
+static void finish_close(struct conn * conn)
+{
+    rlog(RL_DEBUG, "client %lu closing\n", conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    conn_closed(conn);
+    pool_put(&conn_pool, conn);
+}
+
+// in-flight requests still point at the conn and its output buffers, so the
+// socket is only shut down here. the memory goes back once the last
+// completion for it arrives.
+static void uring_close(struct conn * conn)
+{
+    if (conn->closing)
+    {
+        return;
+    }
+
+    conn->closing = 1;
+    shutdown(conn->fd, SHUT_RDWR);
+    if (conn->ops == 0)
+    {
+        finish_close(conn);
+    }
+}
+
+// link up to URING_SEND_CHAIN queued segments so the kernel sends them in
+// order without a round trip per segment. MSG_WAITALL keeps each send from
+// completing short, a failure cancels the rest of the chain.
+static int uring_flush(struct conn * conn)
+{
+    if (conn->sending || conn->closing || conn->out_head == NULL)
+    {
+        return 0;
+    }
+
+    struct io_uring_sqe * sqe = NULL;
+    int count = 0;
+    for (struct segment * segment = conn->out_head; segment && count < URING_SEND_CHAIN; segment = segment->next)
+    {
+        sqe = get_sqe();
+        if (sqe == NULL)
+        {
+            break;
+        }
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t) (uintptr_t) segment->data;
+        sqe->len = segment->len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = pack(conn, OP_SEND);
+        segment->busy = 1;
+        ++conn->sending;
+        ++conn->ops;
+        ++count;
+    }
+
+    if (sqe)
+    {
+        sqe->flags &= ~IOSQE_IO_LINK;
+    }
+
+    if (config.write_ms && !timer_armed(&conn->write_timer))
+    {
+        timer_arm(&wheel, &conn->write_timer, ms_to_ticks(config.write_ms));
+    }
+
+    return 0;
+}
+
+static void handle_accept(struct io_uring_cqe * cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        arm_accept();
+    }
+
+    if (cqe->res < 0)
+    {
+        fprintf(stderr, "accept %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    struct conn * conn = conn_get(&conn_pool);
+    if (conn == NULL)
+    {
+        fprintf(stderr, "no conn for client %d\n", cqe->res);
+        close(cqe->res);
+        return;
+    }
+
+    conn->fd = cqe->res;
+    rlog(RL_DEBUG, "new client accepted %lu\n", conn->fd);
+    conn_open(conn);
+    arm_recv(conn);
+}
+
+static void handle_recv(struct conn * conn, struct io_uring_cqe * cqe)
+{
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more)
+    {
+        conn->reading = 0;
+        --conn->ops;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closing)
+        {
+            ++stats.recv_calls;
+            stats.recv_bytes += cqe->res;
+            conn->last_active = wheel.now;
+            if (config.framing == FRAME_NONE)
+            {
+                timer_cancel(&wheel, &conn->header_timer);
+            }
+
+            if (conn_receive(conn, ring.bufs + (size_t) bid * URING_BUF_SIZE, cqe->res) < 0)
+            {
+                uring_close(conn);
+            }
+            else
+            {
+                uring_flush(conn);
+                if (conn->out_bytes >= config.high_water && !conn->paused)
+                {
+                    ++stats.pauses;
+                    conn->paused = 1;
+                    if (conn->reading)
+                    {
+                        cancel_recv(conn);
+                    }
+                }
+            }
+        }
+        recycle_buffer(bid);
+    }
+    else if (cqe->res == -ENOBUFS)
+    {
+        // every provided buffer is in use, retry once some came back
+        if (!conn->closing && !conn->paused)
+        {
+            conn->next = ring.rearm_list;
+            ring.rearm_list = conn;
+            ++conn->ops;
+        }
+    }
+    else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ECANCELED))
+    {
+        uring_close(conn);
+    }
+
+    if (!more && !conn->reading && !conn->closing && !conn->paused && cqe->res != -ENOBUFS)
+    {
+        arm_recv(conn);
+    }
+}
+
+static void handle_send(struct conn * conn, struct io_uring_cqe * cqe)
+{
+    --conn->sending;
+    ++stats.send_calls;
+
+    if (cqe->res > 0 && !conn->closing)
+    {
+        conn_consume_output(conn, cqe->res);
+    }
+    else if (cqe->res < 0 && cqe->res != -ECANCELED)
+    {
+        uring_close(conn);
+    }
+
+    if (conn->sending || conn->closing)
+    {
+        return;
+    }
+
+    // a short or failed link cancelled the rest of the chain, those segments
+    // are still at the front of the queue and go out with the next chain
+    for (struct segment * segment = conn->out_head; segment && segment->busy; segment = segment->next)
+    {
+        segment->busy = 0;
+    }
+
+    if (conn->paused && conn->out_bytes <= config.high_water / 2)
+    {
+        conn->paused = 0;
+        if (!conn->reading)
+        {
+            arm_recv(conn);
+        }
+    }
+
+    uring_flush(conn);
+}
+
+static void handle_cqe(struct io_uring_cqe * cqe)
+{
+    struct conn * conn = (struct conn *) (uintptr_t) (cqe->user_data & ~OP_MASK);
+    enum uring_op op = cqe->user_data & OP_MASK;
+
+    switch (op)
+    {
+        case OP_ACCEPT:
+            handle_accept(cqe);
+            return;
+        case OP_TICK:
+            if (cqe->res == sizeof(ring.expirations))
+            {
+                timer_wheel_advance(&wheel, ring.expirations);
+            }
+            ring.rearm_due = 1;
+            arm_tick();
+            return;
+        case OP_MAILBOX:
+            if (cqe->res == sizeof(ring.doorbell))
+            {
+                ++stats.mailbox_wakeups;
+            }
+            reactor_drain();
+            arm_mailbox();
+            return;
+        default:
+            break;
+    }
+
+    // hold a reference of our own while dispatching so a close from inside
+    // the handlers is finished here, once, instead of under their feet
+    ++conn->ops;
+    switch (op)
+    {
+        case OP_RECV:
+            handle_recv(conn, cqe);
+            break;
+        case OP_SEND:
+            --conn->ops;
+            handle_send(conn, cqe);
+            break;
+        case OP_CANCEL:
+            --conn->ops;
+            break;
+        default:
+            break;
+    }
+    --conn->ops;
+
+    if (conn->closing && conn->ops == 0)
+    {
+        finish_close(conn);
+    }
+}
+
+static void rearm_starved(void)
+{
+    if (!ring.rearm_due)
+    {
+        return;
+    }
+
+    ring.rearm_due = 0;
+    struct conn * list = ring.rearm_list;
+    ring.rearm_list = NULL;
+
+    while (list)
+    {
+        struct conn * conn = list;
+        list = conn->next;
+        --conn->ops;
+
+        if (conn->closing)
+        {
+            if (conn->ops == 0)
+            {
+                finish_close(conn);
+            }
+        }
+        else if (!conn->reading && !conn->paused)
+        {
+            arm_recv(conn);
+        }
+    }
+}
+
+void * thread_server_uring(void * args)
+{
+    puts("server started (io_uring)\n");
+
+    if (uring_setup() < 0)
+    {
+        return NULL;
+    }
+
+    if (setup_buffers() < 0)
+    {
+        uring_teardown();
+        return NULL;
+    }
+
+    ring.listener = conn_get(&conn_pool);
+    ring.ticker = conn_get(&conn_pool);
+    if (ring.listener == NULL || ring.ticker == NULL)
+    {
+        perror("listener conn < 0\n");
+        teardown_buffers();
+        uring_teardown();
+        return NULL;
+    }
+
+    ring.listener->kind = CONN_LISTENER;
+    ring.listener->fd = open_listener(0);
+    ring.ticker->kind = CONN_TIMER;
+    ring.ticker->fd = open_ticker(TFD_CLOEXEC);
+    if (ring.listener->fd < 0 || ring.ticker->fd < 0)
+    {
+        if (ring.listener->fd >= 0)
+        {
+            close(ring.listener->fd);
+        }
+        pool_put(&conn_pool, ring.ticker);
+        pool_put(&conn_pool, ring.listener);
+        teardown_buffers();
+        uring_teardown();
+        return NULL;
+    }
+
+    start_timers();
+    arm_accept();
+    arm_tick();
+    arm_mailbox();
+
+    while (1)
+    {
+        if (uring_submit(1) < 0)
+        {
+            break;
+        }
+
+        while (1)
+        {
+            struct io_uring_cqe cqe;
+            if (ring.parked_next < ring.parked_count)
+            {
+                cqe = ring.parked[ring.parked_next++];
+            }
+            else
+            {
+                ring.parked_next = 0;
+                ring.parked_count = 0;
+
+                unsigned int head = *ring.cq_head;
+                if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+                {
+                    break;
+                }
+
+                // release the slot before handling it: a handler waiting for
+                // an sqe parks whatever follows and moves the head itself
+                cqe = ring.cqes[head & ring.cq_mask];
+                __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            }
+            handle_cqe(&cqe);
+        }
+
+        rearm_starved();
+    }
+
+    close(ring.ticker->fd);
+    close(ring.listener->fd);
+    pool_put(&conn_pool, ring.ticker);
+    pool_put(&conn_pool, ring.listener);
+    teardown_buffers();
+    uring_teardown();
+    return NULL;
+}
+
+const struct backend uring_backend =
+{
+    .name = "io_uring",
+    .run = thread_server_uring,
+    .close = uring_close,
+    .flush = uring_flush,
+};
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "server.h"
+
+// requests are answered off the reactor: the bytes go to a worker thread,
+// which upper-cases them and posts the answer back through the reactor
+// mailbox. a client always maps to the same worker so its answers stay in
+// order.
+struct job
+{
+    struct job * next;
+    struct conn_ref ref;
+    size_t len;
+    char data[];
+};
+
+struct worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct job * head;
+    struct job ** tail;
+};
+
+static struct worker * workers;
+static unsigned int worker_count;
+
+static void * thread_worker(void * args)
+{
+    struct worker * worker = args;
+
+    while (1)
+    {
+        pthread_mutex_lock(&worker->lock);
+        while (worker->head == NULL)
+        {
+            pthread_cond_wait(&worker->wake, &worker->lock);
+        }
+
+        // take the whole backlog at once, the lock is only held to detach it
+        struct job * jobs = worker->head;
+        worker->head = NULL;
+        worker->tail = &worker->head;
+        pthread_mutex_unlock(&worker->lock);
+
+        while (jobs)
+        {
+            struct job * job = jobs;
+            jobs = job->next;
+
+            for (size_t i = 0; i < job->len; ++i)
+            {
+                job->data[i] = toupper((unsigned char) job->data[i]);
+            }
+
+            if (reactor_send(job->ref, job->data, job->len) < 0)
+            {
+                fprintf(stderr, "worker cannot post a response\n");
+            }
+            free(job);
+        }
+    }
+
+    return NULL;
+}
+
+static ssize_t worker_data(struct conn * conn, const char * data, size_t len)
+{
+    struct job * job = malloc(sizeof(*job) + len);
+    if (job == NULL)
+    {
+        return -1;
+    }
+
+    job->next = NULL;
+    job->ref = conn_ref_get(conn);
+    job->len = len;
+    memcpy(job->data, data, len);
+
+    struct worker * worker = &workers[((uintptr_t) conn / sizeof(*conn)) % worker_count];
+    pthread_mutex_lock(&worker->lock);
+    int idle = worker->head == NULL;
+    *worker->tail = job;
+    worker->tail = &job->next;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (idle)
+    {
+        pthread_cond_signal(&worker->wake);
+    }
+
+    return len;
+}
+
+const struct handler worker_handler =
+{
+    .on_data = worker_data,
+};
+
+int workers_start(unsigned int count)
+{
+    workers = calloc(count, sizeof(*workers));
+    if (workers == NULL)
+    {
+        return -1;
+    }
+
+    worker_count = count;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].wake, NULL);
+        workers[i].tail = &workers[i].head;
+        if (pthread_create(&workers[i].thread, NULL, thread_worker, &workers[i]) != 0)
+        {
+            perror("pthread_create worker\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -5,6 +5,11 @@
  *  (at your option) any later version.
  */
 
+/*
+build:
+gcc -O2 -Wall -pthread recvRawEth.c ../ringlog.c -o recvRawEth
+*/
+
 #include <arpa/inet.h>
 #include <linux/if_packet.h>
 #include <linux/ip.h>
@@ -16,6 +21,10 @@
 #include <sys/socket.h>
 #include <net/if.h>
 #include <netinet/ether.h>
+#include <endian.h>
+#include <unistd.h>
+
+#include "../ringlog.h"
 
 #define DEST_MAC0	0x00
 #define DEST_MAC1	0x00
@@ -28,24 +37,29 @@
 
 #define DEFAULT_IF	"eth0"
 #define BUF_SIZ		1024
+#define DUMP_WORDS	7	/* packet words per hex dump record, one arg is the offset */
 
 int main(int argc, char *argv[])
 {
-	char sender[INET6_ADDRSTRLEN];
 	int sockfd, ret, i;
+	int level = RL_INFO;
+	in_addr_t my_ip = INADDR_NONE;
 	int sockopt;
 	ssize_t numbytes;
 	struct ifreq ifopts;	/* set promiscuous mode */
 	struct ifreq if_ip;	/* get ip addr */
-	struct sockaddr_storage their_addr;
 	uint8_t buf[BUF_SIZ];
 	char ifName[IFNAMSIZ];
 	
-	/* Get interface name */
+	/* Get interface name and log level (debug dumps every packet) */
 	if (argc > 1)
 		strcpy(ifName, argv[1]);
 	else
 		strcpy(ifName, DEFAULT_IF);
+	if (argc > 2 && (level = ringlog_parse_level(argv[2])) < 0) {
+		fprintf(stderr, "usage: %s [interface] [debug|info|warn|error|off]\n", argv[0]);
+		return -1;
+	}
 
 	/* Header structures */
 	struct ether_header *eh = (struct ether_header *) buf;
@@ -78,9 +92,20 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-repeat:	printf("listener: Waiting to recvfrom...\n");
+	/* Look up my device IP addr once, if we can't check then don't */
+	strncpy(if_ip.ifr_name, ifName, IFNAMSIZ-1);
+	if (ioctl(sockfd, SIOCGIFADDR, &if_ip) >= 0)
+		my_ip = ((struct sockaddr_in *)&if_ip.ifr_addr)->sin_addr.s_addr;
+
+	/* Everything per packet is logged off this loop */
+	if (ringlog_start(STDOUT_FILENO, level, 100) < 0) {
+		close(sockfd);
+		exit(EXIT_FAILURE);
+	}
+
+repeat:	rlog(RL_DEBUG, "listener: Waiting to recvfrom...\n");
 	numbytes = recvfrom(sockfd, buf, BUF_SIZ, 0, NULL, NULL);
-	printf("listener: got packet %lu bytes\n", numbytes);
+	rlog(RL_INFO, "listener: got packet %ld bytes\n", numbytes);
 
 	/* Check the packet is for me */
 	if (eh->ether_dhost[0] == DEST_MAC0 &&
@@ -89,9 +114,9 @@ repeat:	printf("listener: Waiting to recvfrom...\n");
 			eh->ether_dhost[3] == DEST_MAC3 &&
 			eh->ether_dhost[4] == DEST_MAC4 &&
 			eh->ether_dhost[5] == DEST_MAC5) {
-		printf("Correct destination MAC address\n");
+		rlog(RL_DEBUG, "Correct destination MAC address\n");
 	} else {
-		printf("Wrong destination MAC: %x:%x:%x:%x:%x:%x\n",
+		rlog(RL_INFO, "Wrong destination MAC: %lx:%lx:%lx:%lx:%lx:%lx\n",
 						eh->ether_dhost[0],
 						eh->ether_dhost[1],
 						eh->ether_dhost[2],
@@ -103,29 +128,31 @@ repeat:	printf("listener: Waiting to recvfrom...\n");
 	}
 
 	/* Get source IP */
-	((struct sockaddr_in *)&their_addr)->sin_addr.s_addr = iph->saddr;
-	inet_ntop(AF_INET, &((struct sockaddr_in*)&their_addr)->sin_addr, sender, sizeof sender);
+	uint32_t sender = ntohl(iph->saddr);
+	rlog(RL_DEBUG, "Source IP: %lu.%lu.%lu.%lu\n", sender >> 24, (sender >> 16) & 0xff,
+			(sender >> 8) & 0xff, sender & 0xff);
 
-	/* Look up my device IP addr if possible */
-	strncpy(if_ip.ifr_name, ifName, IFNAMSIZ-1);
-	if (ioctl(sockfd, SIOCGIFADDR, &if_ip) >= 0) { /* if we can't check then don't */
-		printf("Source IP: %s\n My IP: %s\n", sender, 
-				inet_ntoa(((struct sockaddr_in *)&if_ip.ifr_addr)->sin_addr));
-		/* ignore if I sent it */
-		if (strcmp(sender, inet_ntoa(((struct sockaddr_in *)&if_ip.ifr_addr)->sin_addr)) == 0)	{
-			printf("but I sent it :(\n");
-			ret = -1;
-			goto done;
-		}
+	/* ignore if I sent it */
+	if (my_ip != INADDR_NONE && iph->saddr == my_ip) {
+		rlog(RL_DEBUG, "but I sent it :(\n");
+		ret = -1;
+		goto done;
 	}
 
 	/* UDP payload length */
 	ret = ntohs(udph->len) - sizeof(struct udphdr);
 
-	/* Print packet */
-	printf("\tData:");
-	for (i=0; i<numbytes; i++) printf("%02x:", buf[i]);
-	printf("\n");
+	/* Print packet, big endian words so the hex reads in wire order */
+	if (RL_DEBUG >= ringlog_level) {
+		for (i=0; i<numbytes; i+=DUMP_WORDS * 8) {
+			uint64_t w[DUMP_WORDS] = {0};
+			int n = numbytes - i < DUMP_WORDS * 8 ? numbytes - i : DUMP_WORDS * 8;
+			memcpy(w, buf + i, n);
+			rlog(RL_DEBUG, "\tData %04lx: %016lx %016lx %016lx %016lx %016lx %016lx %016lx\n", i,
+					be64toh(w[0]), be64toh(w[1]), be64toh(w[2]), be64toh(w[3]),
+					be64toh(w[4]), be64toh(w[5]), be64toh(w[6]));
+		}
+	}
 
 done:	goto repeat;
 
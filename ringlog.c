@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+#include "ringlog.h"
+
+#define OUT_SIZE    (64 * 1024)         // formatted bytes per write
+#define LINE_SIZE   512
+
+// one per logging thread, the thread is the only producer and the writer
+// the only consumer. rings are never freed, a thread that exits leaves its
+// records to be drained.
+struct ring
+{
+    struct ring * next;
+    uint64_t head __attribute__((aligned(64)));    // writer side
+    uint64_t tail __attribute__((aligned(64)));    // thread side
+    uint64_t dropped;
+    uint64_t reported;                  // dropped count the writer last saw
+    struct ringlog_record slots[RINGLOG_SLOTS];
+};
+
+int ringlog_level = RL_OFF;
+
+static struct ring * rings;
+static __thread struct ring * local;
+static int out_fd = -1;
+static int doorbell = -1;
+static unsigned int interval;
+static int stop;
+static pthread_t writer;
+
+static char out[OUT_SIZE];
+static size_t out_len;
+
+static struct ring * ring_register(void)
+{
+    struct ring * ring = calloc(1, sizeof(*ring));
+    if (!ring)
+    {
+        return NULL;
+    }
+
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+    local = ring;
+    return ring;
+}
+
+void ringlog_write(int level, const char * fmt, uint32_t argc, const uint64_t * args)
+{
+    struct ring * ring = local ? local : ring_register();
+    if (!ring)
+    {
+        return;
+    }
+
+    uint64_t tail = ring->tail;
+    uint64_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (used == RINGLOG_SLOTS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct ringlog_record * record = &ring->slots[tail & (RINGLOG_SLOTS - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->fmt = fmt;
+    record->level = level;
+    record->argc = argc;
+    memcpy(record->args, args, sizeof(record->args));
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // ring the writer once per fill instead of waiting out the interval
+    if (used + 1 == RINGLOG_SLOTS / 2)
+    {
+        uint64_t one = 1;
+        if (write(doorbell, &one, sizeof(one)) < 0)
+        {
+        }
+    }
+}
+
+static void out_flush(void)
+{
+    size_t done = 0;
+    while (done < out_len)
+    {
+        ssize_t n = write(out_fd, out + done, out_len - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    out_len = 0;
+}
+
+static void out_format(const struct ringlog_record * record)
+{
+    static const char tags[] = "DIWE";
+
+    if (OUT_SIZE - out_len < LINE_SIZE)
+    {
+        out_flush();
+    }
+
+    char * line = out + out_len;
+    int prefix = snprintf(line, LINE_SIZE, "%lu.%06lu %c ", (unsigned long) (record->time / 1000000000ULL),
+                          (unsigned long) (record->time % 1000000000ULL / 1000), tags[record->level & 3]);
+
+    const uint64_t * a = record->args;
+    int n = snprintf(line + prefix, LINE_SIZE - prefix, record->fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    if (n >= LINE_SIZE - prefix)
+    {
+        n = LINE_SIZE - prefix - 1;
+        line[prefix + n - 1] = '\n';
+    }
+    out_len += prefix + n;
+}
+
+static void drain(void)
+{
+    for (struct ring * ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+    {
+        uint64_t head = ring->head;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            out_format(&ring->slots[head & (RINGLOG_SLOTS - 1)]);
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported)
+        {
+            struct ringlog_record record = {
+                .fmt = "ringlog: dropped %lu records\n",
+                .level = RL_WARN,
+                .args = { dropped - ring->reported },
+            };
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            record.time = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+            out_format(&record);
+            ring->reported = dropped;
+        }
+    }
+    out_flush();
+}
+
+static void * writer_thread(void * args)
+{
+    (void) args;
+    struct pollfd pfd = { .fd = doorbell, .events = POLLIN };
+
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+    {
+        if (poll(&pfd, 1, interval) > 0)
+        {
+            uint64_t count;
+            if (read(doorbell, &count, sizeof(count)) < 0)
+            {
+            }
+        }
+        drain();
+    }
+
+    drain();
+    return NULL;
+}
+
+int ringlog_start(int fd, int level, unsigned int interval_ms)
+{
+    out_fd = fd;
+    interval = interval_ms;
+    doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (doorbell < 0)
+    {
+        perror("eventfd ringlog\n");
+        return -1;
+    }
+
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0)
+    {
+        perror("pthread_create ringlog\n");
+        close(doorbell);
+        return -1;
+    }
+
+    __atomic_store_n(&ringlog_level, level, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void ringlog_stop(void)
+{
+    if (doorbell < 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(&ringlog_level, RL_OFF, __ATOMIC_RELAXED);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(doorbell, &one, sizeof(one)) < 0)
+    {
+    }
+    pthread_join(writer, NULL);
+    close(doorbell);
+    doorbell = -1;
+}
+
+int ringlog_parse_level(const char * name)
+{
+    static const char * names[] = { "debug", "info", "warn", "error", "off" };
+    for (int level = RL_DEBUG; level <= RL_OFF; ++level)
+    {
+        if (strcmp(name, names[level]) == 0)
+        {
+            return level;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,79 @@
+#ifndef RINGLOG_H
+#define RINGLOG_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum ringlog_level
+{
+    RL_DEBUG,
+    RL_INFO,
+    RL_WARN,
+    RL_ERROR,
+    RL_OFF,
+};
+
+#define RINGLOG_ARGS    8               // arguments a record carries
+#define RINGLOG_SLOTS   4096            // records per thread ring, power of two
+
+// what a hot path writes: the format string is the format id, it is only
+// looked at by the writer thread, so it has to be a string literal. every
+// argument is widened to 64 bits, so formats use %lu, %ld, %lx or %s for
+// another string literal, never %d or a string built on the stack.
+struct ringlog_record
+{
+    uint64_t time;                      // CLOCK_REALTIME ns
+    const char * fmt;
+    uint32_t level;
+    uint32_t argc;
+    uint64_t args[RINGLOG_ARGS];
+};
+
+// records below this level cost one load and one branch
+extern int ringlog_level;
+
+// starts the writer thread formatting into fd. every interval_ms, or as
+// soon as a ring fills up by half, it drains all thread rings and writes
+// what it formatted in one go. a full ring drops records and counts them,
+// logging never blocks the caller.
+int ringlog_start(int fd, int level, unsigned int interval_ms);
+// drains what is left and joins the writer
+void ringlog_stop(void);
+void ringlog_write(int level, const char * fmt, uint32_t argc, const uint64_t * args);
+// debug, info, warn, error or off, -1 for anything else
+int ringlog_parse_level(const char * name);
+
+#define RINGLOG_COUNT(...)  RINGLOG_COUNT_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define RINGLOG_COUNT_(z, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+#define RINGLOG_CAST(n, ...)    RINGLOG_CAST_(n, ##__VA_ARGS__)
+#define RINGLOG_CAST_(n, ...)   RINGLOG_CAST_##n(__VA_ARGS__)
+#define RINGLOG_CAST_0()
+#define RINGLOG_CAST_1(a)       (uint64_t) (a)
+#define RINGLOG_CAST_2(a, ...)  (uint64_t) (a), RINGLOG_CAST_1(__VA_ARGS__)
+#define RINGLOG_CAST_3(a, ...)  (uint64_t) (a), RINGLOG_CAST_2(__VA_ARGS__)
+#define RINGLOG_CAST_4(a, ...)  (uint64_t) (a), RINGLOG_CAST_3(__VA_ARGS__)
+#define RINGLOG_CAST_5(a, ...)  (uint64_t) (a), RINGLOG_CAST_4(__VA_ARGS__)
+#define RINGLOG_CAST_6(a, ...)  (uint64_t) (a), RINGLOG_CAST_5(__VA_ARGS__)
+#define RINGLOG_CAST_7(a, ...)  (uint64_t) (a), RINGLOG_CAST_6(__VA_ARGS__)
+#define RINGLOG_CAST_8(a, ...)  (uint64_t) (a), RINGLOG_CAST_7(__VA_ARGS__)
+
+// rlog(RL_DEBUG, "client %lu closing\n", fd);
+#define rlog(level, fmt, ...)                                                           \
+    do                                                                                  \
+    {                                                                                   \
+        if (__builtin_expect((level) >= ringlog_level, 0))                              \
+        {                                                                               \
+            uint64_t rlog_args_[RINGLOG_ARGS] = {                                       \
+                RINGLOG_CAST(RINGLOG_COUNT(__VA_ARGS__), ##__VA_ARGS__) };              \
+            ringlog_write(level, "" fmt, RINGLOG_COUNT(__VA_ARGS__), rlog_args_);       \
+        }                                                                               \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RINGLOG_H
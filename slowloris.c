@@ -2,6 +2,11 @@
 // Created by hooman on 6/13/23.
 //
 
+/*
+build:
+gcc -O2 -Wall -pthread slowloris.c ringlog.c -o slowloris
+*/
+
 #define __USE_GNU
 #define _GNU_SOURCE
 
@@ -24,6 +29,8 @@
 #include <net/if.h>
 #include <fcntl.h>
 
+#include "ringlog.h"
+
 void print_help()
 {
     printf("options\n"
@@ -34,6 +41,7 @@ void print_help()
            "\t -b, --bytes              number of bytes send in each loop\n"
            "\t -d, --data               payload in hex-string format\n"
            "\t -t, --timeout            poll timeout in ms\n"
+           "\t -l, --log-level          debug, info (default), warn, error or off\n"
            );
 }
 
@@ -46,6 +54,7 @@ static struct option long_options[] =
         {"bytes", required_argument, 0, 'b'},
         {"data", required_argument, 0, 'd'},
         {"timeout", required_argument, 0, 't'},
+        {"log-level", required_argument, 0, 'l'},
         {0, 0, 0, 0},
 };
 
@@ -74,6 +83,10 @@ static struct
     struct sockaddr_in serv_addr;
 } state;
 
+// set by the signal handler: the logger thread cannot be joined from there,
+// what it has not written yet is lost
+static volatile sig_atomic_t in_signal;
+
 //void * thread_connection(void * arg)
 //{
 //    return NULL;
@@ -95,6 +108,10 @@ void clear_state()
     free(state.buffer);
     free(state.poll);
     free(state.connections);
+    if (!in_signal)
+    {
+        ringlog_stop();
+    }
 }
 
 void sigHandle(int signal)
@@ -112,6 +129,7 @@ void sigHandle(int signal)
     }
 
     free(strings);
+    in_signal = 1;
     clear_state();
     exit(-1);
 }
@@ -212,13 +230,14 @@ int main(int argc, const char * argv[])
 
     char buffer[1024];
     int param_count = 0;
+    int log_level = RL_INFO;
     int opt;
 
     state.bytes = 10;
     state.sleep = 10000;
     state.poll_timeout = 1000;
 
-    while ((opt = getopt_long(argc, argv, "i:p:s:c:b:d:t:", long_options, NULL)) != -1)
+    while ((opt = getopt_long(argc, argv, "i:p:s:c:b:d:t:l:", long_options, NULL)) != -1)
     {
         switch (opt)
         {
@@ -246,6 +265,14 @@ int main(int argc, const char * argv[])
             case 't':
                 state.poll_timeout = atoi(optarg);
                 break;
+            case 'l':
+                log_level = ringlog_parse_level(optarg);
+                if (log_level < 0)
+                {
+                    print_help();
+                    return -1;
+                }
+                break;
             default:
                 print_help();
                 return -1;
@@ -259,6 +286,11 @@ int main(int argc, const char * argv[])
         return -1;
     }
 
+    if (ringlog_start(STDOUT_FILENO, log_level, 100) < 0)
+    {
+        return -1;
+    }
+
     state.poll_connection_map = calloc(state.connection_count, sizeof(int));
     if (state.poll_connection_map == NULL)
     {
@@ -342,7 +374,7 @@ int main(int argc, const char * argv[])
                 }
 
                 state.connections[i].connected = 1;
-                printf("socket %d connected\n", state.connections[i].socket_fd);
+                rlog(RL_INFO, "socket %lu connected\n", state.connections[i].socket_fd);
             }
 
             if (state.connections[i].socket_fd && state.connections[i].connected != 0)
@@ -388,27 +420,13 @@ int main(int argc, const char * argv[])
                 continue;
             }
 
-            printf("fd: %d, revent: %X -> %s%s%s%s%s%s%s%s%s%s%s%s%s\n",
-                   state.poll[i].fd, revent,
-                   (revent & POLLIN) ? "POLLIN ": "",
-                   (revent & POLLPRI) ? "POLLPRI ": "",
-                   (revent & POLLOUT) ? "POLLOUT ": "",
-                   (revent & POLLRDNORM) ? "POLLRDNORM ": "",
-                   (revent & POLLRDBAND) ? "POLLRDBAND ": "",
-                   (revent & POLLWRNORM) ? "POLLWRNORM ": "",
-                   (revent & POLLWRBAND) ? "POLLWRBAND ": "",
-                   (revent & POLLMSG) ? "POLLMSG ": "",
-                   (revent & POLLREMOVE) ? "POLLREMOVE ": "",
-                   (revent & POLLRDHUP) ? "POLLRDHUP ": "",
-                   (revent & POLLERR) ? "POLLERR ": "",
-                   (revent & POLLHUP) ? "POLLHUP ": "",
-                   (revent & POLLNVAL) ? "POLLNVAL ": "");
+            rlog(RL_DEBUG, "fd: %lu, revent: %lX\n", state.poll[i].fd, revent);
 
             assert(state.connections[state.poll_connection_map[i]].socket_fd == state.poll[i].fd);
             if ((revent & POLLRDHUP) || (revent & POLLHUP))
             {
                 int socket_index = state.poll_connection_map[i];
-                printf("socket %d disconnected\n", state.connections[socket_index].socket_fd);
+                rlog(RL_INFO, "socket %lu disconnected\n", state.connections[socket_index].socket_fd);
                 shutdown(state.connections[socket_index].socket_fd, SHUT_RDWR);
 
                 close(state.connections[socket_index].socket_fd);